@@ -0,0 +1,43 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#ifndef NAVGROUND_ONNX_DAEMON_CLIENT_H_
+#define NAVGROUND_ONNX_DAEMON_CLIENT_H_
+
+#include "navground/core/types.h"
+#include "navground_onnx/export.h"
+#include "navground_onnx/shm_protocol.h"
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+namespace navground::onnx {
+
+// Runs inference in `navground_onnx_daemon` through shared memory
+class NAVGROUND_ONNX_EXPORT DaemonClient {
+public:
+  DaemonClient(const std::string &name, const std::filesystem::path &model,
+               size_t rows, size_t observation_size, size_t action_size,
+               std::chrono::milliseconds timeout = std::chrono::seconds(5));
+  ~DaemonClient();
+
+  DaemonClient(const DaemonClient &) = delete;
+  DaemonClient &operator=(const DaemonClient &) = delete;
+
+  // Sends `rows x observation_size` observations and waits for
+  // `rows x action_size` actions
+  void run(const ng_float_t *observations, ng_float_t *actions);
+
+private:
+  shm::Registry *_registry;
+  size_t _slot;
+  std::string _segment_name;
+  shm::ClientHeader *_header;
+  shm::Layout _layout;
+  std::chrono::milliseconds _timeout;
+};
+
+} // namespace navground::onnx
+
+#endif // NAVGROUND_ONNX_DAEMON_CLIENT_H_
@@ -8,6 +8,9 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include <cstddef>
+#include <fstream>
+
 class SuppressStdErr {
 public:
   SuppressStdErr() {
@@ -26,4 +29,15 @@ private:
   int _fd;
 };
 
+// Resident memory of the current process in bytes (0 if not available)
+inline size_t get_resident_memory() {
+  std::ifstream statm("/proc/self/statm");
+  size_t size = 0;
+  size_t resident = 0;
+  if (!(statm >> size >> resident)) {
+    return 0;
+  }
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
 #endif // NAVGROUND_ONNX_IO_UTILS_H_
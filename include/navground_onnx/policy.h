@@ -9,12 +9,19 @@
 #include "navground/core/buffer.h"
 #include "navground/core/states/sensing.h"
 #include "navground/core/types.h"
+#include "navground_onnx/daemon_client.h"
 #include "navground_onnx/export.h"
+#include "navground_onnx/preprocessing.h"
+#include <condition_variable>
+#include <exception>
 #include <filesystem>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <onnxruntime_cxx_api.h>
 #include <optional>
+#include <string>
+#include <thread>
 #include <vector>
 
 namespace navground::onnx {
@@ -28,10 +35,13 @@ struct NAVGROUND_ONNX_EXPORT ControlActionConfig {
   bool use_acceleration_action;
   bool fix_orientation;
   bool use_wheels;
+  // whether actions include the transversal speed (for holonomic agents)
+  bool use_transversal;
 
   auto tie() const {
     return std::tie(max_acceleration, max_angular_acceleration,
-                    use_acceleration_action, fix_orientation, use_wheels);
+                    use_acceleration_action, fix_orientation, use_wheels,
+                    use_transversal);
   }
 
   bool operator==(const ControlActionConfig &other) const {
@@ -41,7 +51,7 @@ struct NAVGROUND_ONNX_EXPORT ControlActionConfig {
   ControlActionConfig()
       : max_acceleration(10), max_angular_acceleration(100),
         use_acceleration_action(false), fix_orientation(false),
-        use_wheels(false) {}
+        use_wheels(false), use_transversal(false) {}
 };
 
 struct NAVGROUND_ONNX_EXPORT DefaultObservationConfig {
@@ -83,6 +93,43 @@ struct NAVGROUND_ONNX_EXPORT DefaultObservationConfig {
         max_radius(std::numeric_limits<ng_float_t>::infinity()) {}
 };
 
+// The action used when inference misses the deadline
+enum class Fallback {
+  last,  // the last action
+  decay, // the last action, scaled by `fallback_decay` at each miss
+  zero   // a zero action
+};
+
+struct NAVGROUND_ONNX_EXPORT InferenceConfig {
+  // name of the local inference daemon (empty to run inference in-process)
+  std::string daemon;
+  // maximal time to wait for inference [s] (0 to always wait)
+  ng_float_t latency_budget;
+  Fallback fallback;
+  ng_float_t fallback_decay;
+  // names of the recurrent states, paired by position (empty to pair
+  // outputs `<name>_out` with inputs `<name>_in` or `<name>`)
+  std::vector<std::string> recurrent_inputs;
+  std::vector<std::string> recurrent_outputs;
+  // axis of the recurrent states along which behaviors are batched
+  // (negative to use the first dynamic axis)
+  int recurrent_batch_axis;
+
+  auto tie() const {
+    return std::tie(daemon, latency_budget, fallback, fallback_decay,
+                    recurrent_inputs, recurrent_outputs, recurrent_batch_axis);
+  }
+
+  bool operator==(const InferenceConfig &other) const {
+    return tie() == other.tie();
+  }
+
+  InferenceConfig()
+      : daemon(), latency_budget(0), fallback(Fallback::last),
+        fallback_decay(0.5), recurrent_inputs(), recurrent_outputs(),
+        recurrent_batch_axis(-1) {}
+};
+
 struct NAVGROUND_ONNX_EXPORT Action {
   ng_float_t *wheels;
   ng_float_t *longitudinal;
@@ -93,9 +140,20 @@ struct NAVGROUND_ONNX_EXPORT Action {
   ng_float_t max_acceleration;
   ng_float_t max_angular_acceleration;
   bool is_acceleration;
+  // number of values per agent
+  size_t size;
+  // reused to avoid allocating when decoding wheel actions
+  mutable core::WheelSpeeds wheel_speeds;
+
+  // The number of values per agent: 2 (`[left, right]`) if using wheels,
+  // else `[longitudinal, transversal, angular]`, where transversal is present
+  // only if using it and angular only if not fixing the orientation.
+  static size_t get_size(const ControlActionConfig &config);
+  // Points the action to the first row of `data`
+  void bind(ng_float_t *data, const ControlActionConfig &config);
 
   core::Twist2 get_cmd(const core::Behavior &behavior, ng_float_t time_step,
-                       size_t index) const;
+                       size_t index = 0) const;
 };
 
 struct NAVGROUND_ONNX_EXPORT EgoState {
@@ -121,6 +179,68 @@ struct NAVGROUND_ONNX_EXPORT TargetState {
   void update(const core::Behavior &behavior, size_t index);
 };
 
+// A state output of a recurrent model that is fed back as input at the next
+// step. The two buffers alternate as input and output.
+struct NAVGROUND_ONNX_EXPORT RecurrentState {
+  core::Buffer *buffers[2];
+  // indices of the tensors among the inputs and the outputs
+  size_t input;
+  size_t output;
+  // index of the buffer currently bound to the input
+  unsigned current;
+  size_t axis;
+  // sizes before, along and after the batch axis
+  size_t outer;
+  size_t batches;
+  size_t inner;
+
+  // Sets the state of a batch row to zero
+  void reset(size_t index);
+  // Copies a batch row from the buffer bound to the output to the buffer
+  // bound to the input
+  void take_output(size_t index);
+  // Appends the state of a batch row, as bound to the input, to `values`
+  void save(size_t index, std::vector<ng_float_t> &values) const;
+  // Sets the state of a batch row from `values`, starting at `offset`, and
+  // returns the offset of the next state
+  size_t load(size_t index, const std::vector<ng_float_t> &values,
+              size_t offset);
+};
+
+// Copies the same sensing buffer of all behaviors in the rows of a
+// batched buffer
+struct NAVGROUND_ONNX_EXPORT SensingGather {
+  core::Buffer *destination;
+  std::vector<const core::Buffer *> sources;
+
+  void update() const;
+  // Copies only the buffer of the behavior at `index`
+  void update(size_t index) const;
+};
+
+// The part of the target that, when changed, resets the recurrent states
+struct NAVGROUND_ONNX_EXPORT TargetKey {
+  std::optional<core::Vector2> position;
+  std::optional<ng_float_t> orientation;
+  std::optional<core::Vector2> direction;
+
+  bool operator==(const TargetKey &other) const {
+    return position == other.position && orientation == other.orientation &&
+           direction == other.direction;
+  }
+};
+
+struct NAVGROUND_ONNX_EXPORT PolicyStats {
+  // increase of resident memory while loading the session [bytes]
+  size_t session_memory;
+  // number of steps that requested inference
+  size_t steps;
+  // number of steps that used the fallback action
+  size_t deadline_misses;
+
+  PolicyStats() : session_memory(0), steps(0), deadline_misses(0) {}
+};
+
 NAVGROUND_ONNX_EXPORT
 core::SensingState *get_sensing(const core::Behavior &behavior);
 
@@ -134,38 +254,108 @@ struct NAVGROUND_ONNX_EXPORT Policy {
 
   ControlActionConfig action_config;
   DefaultObservationConfig observation_config;
+  InferenceConfig inference_config;
   std::filesystem::path path;
 
   Policy(const ControlActionConfig &action_config,
          const DefaultObservationConfig &observation_config,
-         const std::filesystem::path &path);
+         const std::filesystem::path &path,
+         const InferenceConfig &inference_config = InferenceConfig());
   virtual core::Twist2 get_cmd(const core::Behavior &behavior,
                                ng_float_t time_step);
   virtual int64_t get_number_of_batches() const;
   void run();
 
-  virtual ~Policy() = default;
+  virtual ~Policy();
 
+  // Prepares the buffers for the current number of batches; can be called
+  // again when the number of batches changes.
   void prepare(const core::Behavior &);
 
+  const PolicyStats &get_stats() const { return _stats; }
+
 protected:
   FlatBufferIterator flat_buffer_interator() const;
+  void update_recurrent_states(const core::Behavior &behavior, size_t index);
+  void gather_sensing() const;
+  void gather_sensing(size_t index) const;
+  // Whether an inference that missed the deadline is still running: in this
+  // case, inputs should not be touched and `skip` called instead of `run`.
+  // Once it has completed, its actions replace the fallback.
+  bool is_running();
+  void skip();
+  // Whether inference can run for a single batch row
+  bool has_row_bindings() const { return !_row_inputs.empty(); }
+  // Runs inference for a single batch row, whose inputs are already set,
+  // and keeps its new recurrent states.
+  void run_row(size_t index);
+  // Whether the target of the behavior is the one its recurrent states
+  // were last computed for
+  bool has_same_target(const core::Behavior &behavior, size_t index) const;
   Action _action;
   TargetState _target_state;
   EgoState _ego_state;
   std::map<std::string, core::Buffer> _state_buffers;
+  // the sensing states of all behaviors, in batch order
+  std::vector<core::SensingState *> _sensings;
+  std::vector<SensingGather> _sensing_gathers;
   bool _initialized;
+  // the number of batches the buffers have been prepared for
+  int64_t _batches;
+  PolicyStats _stats;
+  std::vector<RecurrentState> _recurrent_states;
+  // the targets of each batch row (none if the row should be reset)
+  std::vector<std::optional<TargetKey>> _recurrent_targets;
 
 private:
+  void reset();
+  void run_inference();
+  void run_with_deadline();
+  // Copies the actions computed by the worker, or rethrows its exception
+  void take_result();
+  void apply_fallback();
+  void work();
+  std::vector<std::pair<std::string, std::string>> get_recurrent_pairs() const;
+  void prepare_recurrent_states(int64_t batches);
+  void prepare_row_bindings(int64_t batches);
+  void prepare_sensing_gathers(int64_t batches);
+  void prepare_preprocessing(const Preprocessing &preprocessing,
+                             int64_t batches);
+  void validate_bindings() const;
   core::Buffer _flat_buffer;
   std::vector<Ort::Value> _inputs;
   std::vector<const char *> _input_names;
   std::map<std::string, core::Buffer> _output_buffers;
+  core::Buffer *_action_buffer;
   std::vector<Ort::Value> _outputs;
   std::vector<const char *> _output_names;
-  Ort::Env _env;
+  // tensors bound to the slices of the inputs and outputs for each batch row
+  std::vector<std::vector<Ort::Value>> _row_inputs;
+  std::vector<std::vector<Ort::Value>> _row_outputs;
+  Ort::RunOptions _run_options;
+  std::map<std::string, core::Buffer> _recurrent_buffers;
+  std::map<std::string, core::Buffer> _sensing_buffers;
+  std::vector<PreprocessingStage> _preprocessing;
+  // shared by all policies: the env holds the process-wide CPU allocator and
+  // the container holds the weights pre-packed by the sessions.
+  std::shared_ptr<Ort::Env> _env;
+  std::shared_ptr<Ort::PrePackedWeightsContainer> _prepacked_weights;
   std::unique_ptr<Ort::Session> _session;
+  // used instead of the session when running inference in the daemon
+  std::unique_ptr<DaemonClient> _daemon_client;
   std::vector<const std::map<std::string, core::Buffer> *> _input_buffers;
+  // with a latency budget, inference runs in the worker, which writes into
+  // the output buffers, while actions are decoded from `_actions`.
+  core::Buffer _actions;
+  std::thread _worker;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _requested;
+  bool _running;
+  // whether the running inference missed the deadline
+  bool _late;
+  bool _stop;
+  std::exception_ptr _exception;
 };
 
 } // namespace navground::onnx
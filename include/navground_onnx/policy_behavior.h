@@ -21,8 +21,8 @@ public:
       ng_float_t radius = 0,
       const std::filesystem::path &path = std::filesystem::path(""))
       : core::Behavior(kinematics, radius), action_config(),
-        observation_config(), _policy_path(std::filesystem::absolute(path)),
-        _shared(false), _env_state() {}
+        observation_config(), inference_config(), _policy_path(std::filesystem::absolute(path)),
+        _shared(false), _auto_shared(false), _env_state() {}
 
   core::Twist2 compute_cmd_internal(ng_float_t time_step) override;
 
@@ -54,8 +54,13 @@ public:
 
   void set_shared(bool value) { _shared = value; }
 
+  bool get_auto_shared() const { return _auto_shared; }
+
+  void set_auto_shared(bool value) { _auto_shared = value; }
+
   ControlActionConfig action_config;
   DefaultObservationConfig observation_config;
+  InferenceConfig inference_config;
 
   static const std::string type;
 
@@ -68,6 +73,7 @@ public:
 private:
   std::filesystem::path _policy_path;
   bool _shared;
+  bool _auto_shared;
   std::shared_ptr<Policy> _policy;
   core::SensingState _env_state;
 };
@@ -0,0 +1,67 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#ifndef NAVGROUND_ONNX_PREPROCESSING_H_
+#define NAVGROUND_ONNX_PREPROCESSING_H_
+
+#include "navground/core/types.h"
+#include "navground_onnx/export.h"
+#include <filesystem>
+#include <map>
+#include <onnxruntime_cxx_api.h>
+#include <string>
+#include <vector>
+
+namespace navground::onnx {
+
+// Per-feature transformation of an input: y = clip(x, low, high) * scale +
+// offset. Each field holds one value per feature, or a single value that
+// applies to all features.
+struct NAVGROUND_ONNX_EXPORT FeatureTransform {
+  std::vector<ng_float_t> low;
+  std::vector<ng_float_t> high;
+  std::vector<ng_float_t> scale;
+  std::vector<ng_float_t> offset;
+
+  // Broadcasts all fields to `features` values, filling missing fields with
+  // the identity. Throws if a field has a different number of values.
+  void fit(size_t features);
+};
+
+// Transformations indexed by input name
+using Preprocessing = std::map<std::string, FeatureTransform>;
+
+// Reads the transformations from the model custom metadata, with keys
+// `preprocessing.<input>.<field>`, and then from the sidecar file
+// `<model>.preprocessing.yaml`, if present, like
+//
+// observation:
+//   low: [-1, -1, 0]
+//   high: [1, 1, 5]
+//   scale: [1, 1, 0.2]
+//   offset: 0
+//
+// Values from the sidecar file override values from the metadata.
+NAVGROUND_ONNX_EXPORT
+Preprocessing load_preprocessing(const std::filesystem::path &model,
+                                 const Ort::Session *session = nullptr);
+
+// A transformation applied in place to a batched input of shape
+// `{rows, features}`
+struct NAVGROUND_ONNX_EXPORT PreprocessingStage {
+  ng_float_t *data;
+  size_t rows;
+  FeatureTransform transform;
+
+  void apply() const;
+  // Applies the transformation to a single row
+  void apply(size_t row) const;
+
+private:
+  void apply(size_t begin, size_t end) const;
+};
+
+} // namespace navground::onnx
+
+#endif // NAVGROUND_ONNX_PREPROCESSING_H_
@@ -6,7 +6,11 @@
 #define NAVGROUND_ONNX_SHARED_POLICY_H_
 
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <tuple>
+#include <valarray>
 #include <vector>
 
 #include "navground_onnx/export.h"
@@ -14,25 +18,104 @@
 
 namespace navground::onnx {
 
+// What, in addition to the configuration, behaviors need to have in common
+// to be grouped automatically
+struct NAVGROUND_ONNX_EXPORT ModelSignature {
+  // hash of the content of the model
+  size_t model;
+  ng_float_t max_speed;
+  ng_float_t max_angular_speed;
+  ng_float_t horizon;
+  // key, size, and type of the sensing buffers
+  std::vector<std::tuple<std::string, size_t, std::string>> sensing;
+
+  auto tie() const {
+    return std::tie(model, max_speed, max_angular_speed, horizon, sensing);
+  }
+
+  bool operator==(const ModelSignature &other) const {
+    return tie() == other.tie();
+  }
+
+  ModelSignature(const core::Behavior &behavior,
+                 const std::filesystem::path &path);
+};
+
 // all behaviors in share the same policy and config
 struct NAVGROUND_ONNX_EXPORT SharedPolicy final: public Policy {
 
   SharedPolicy(const ControlActionConfig &action_config,
                const DefaultObservationConfig &observation_config,
-               const std::filesystem::path &path);
+               const std::filesystem::path &path,
+               const InferenceConfig &inference_config = InferenceConfig());
   core::Twist2 get_cmd(const core::Behavior &behavior,
                        ng_float_t time_step) override;
   int64_t get_number_of_batches() const override;
+  // Gathers the observations of all behaviors in the group and runs
+  // inference once for the whole batch.
+  void update();
+  // Updates, concurrently, the groups of the given behaviors, like those of
+  // a world. Call it once per step, when the observations of all behaviors
+  // are up-to-date, so that computing their commands does not run inference
+  // again (see `update_shared_policies` for navground_sim worlds).
+  static void update_all(const std::vector<core::Behavior *> &behaviors);
   void leave(const core::Behavior &behavior);
   static std::shared_ptr<SharedPolicy>
   join(const core::Behavior &behavior, const ControlActionConfig &action_config,
        const DefaultObservationConfig &observation_config,
-       const std::filesystem::path &path);
+       const std::filesystem::path &path,
+       const InferenceConfig &inference_config = InferenceConfig());
+  // Joins the group of behaviors with the same configuration and model
+  // signature. Contrary to `join`, behaviors with different paths to
+  // identical models are grouped together.
+  //
+  // Groups are per thread: behaviors of worlds that run in parallel never
+  // share a policy.
+  static std::shared_ptr<SharedPolicy>
+  join_auto(const core::Behavior &behavior,
+            const ControlActionConfig &action_config,
+            const DefaultObservationConfig &observation_config,
+            const std::filesystem::path &path,
+            const InferenceConfig &inference_config = InferenceConfig());
 
 private:
+  struct Registry;
   std::vector<core::Behavior *> _behaviors;
+  // the behaviors of the batch rows, as last prepared (null if they left)
+  std::vector<core::Behavior *> _rows;
+  // whether behaviors have joined or left since the last preparation
+  bool _changed;
+  // whether the behavior has already read its action since the last update
+  std::vector<uint8_t> _consumed;
+  // the observations, before preprocessing, used by the last update
+  std::valarray<ng_float_t> _observed;
+  // the current observation of the behavior that is computing its command
+  std::valarray<ng_float_t> _observation;
+  size_t _observation_size;
+  // set for automatic groups
+  std::optional<ModelSignature> _signature;
+  std::weak_ptr<Registry> _registry;
+  // guards the members of the group, which may leave from another thread
+  std::mutex _group_mutex;
   std::optional<size_t> index_of(const core::Behavior &behavior);
-  static std::vector<std::shared_ptr<SharedPolicy>> _policies;
+  void add(const core::Behavior &behavior);
+  // Prepares the buffers for the current behaviors, keeping the recurrent
+  // states of those that were already in the group
+  void resize();
+  // Writes the observation of the behavior at `index`, after updating its
+  // state buffers
+  void observe(size_t index, FlatBufferIterator out);
+  // Whether the observation or the target of the behavior at `index` has
+  // changed since the last update
+  bool has_changed(size_t index);
+  // Whether the next behavior in the group has changed too, which suggests
+  // that all behaviors have new observations
+  bool has_next_changed(size_t index);
+  // Like `update`, with the group mutex already locked
+  void update_batch();
+  // Runs inference for the behavior at `index` only
+  void update_row(size_t index);
+  static std::shared_ptr<Registry> get_registry();
 };
 
 // void deinit_policy(core::Behavior &behavior);
@@ -0,0 +1,99 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#ifndef NAVGROUND_ONNX_SHM_PROTOCOL_H_
+#define NAVGROUND_ONNX_SHM_PROTOCOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Shared memory layout used by `navground_onnx_daemon` and its clients.
+//
+// The daemon owns a registry segment `/<name>` where each client registers
+// the name of its own segment. A client segment holds a header followed by
+// a ring of slots, each with the observations of one request and the
+// corresponding actions. Clients publish requests by incrementing
+// `requested`; the daemon batches the pending requests of all clients that
+// use the same model, runs inference once, and increments `served`.
+namespace navground::onnx::shm {
+
+constexpr uint32_t version = 1;
+constexpr size_t max_clients = 256;
+constexpr size_t max_name = 64;
+constexpr size_t max_path = 1024;
+constexpr size_t ring_size = 4;
+// upper bounds of the sizes that a client can request
+constexpr uint32_t max_rows = 1024;
+constexpr uint32_t max_observation_size = 4096;
+constexpr uint32_t max_action_size = 64;
+constexpr const char *default_name = "navground_onnx";
+
+// states of the registry slots
+constexpr uint32_t slot_empty = 0;
+constexpr uint32_t slot_claimed = 1;
+constexpr uint32_t slot_ready = 2;
+constexpr uint32_t slot_closing = 3;
+
+struct Registry {
+  // set by the daemon once the registry is ready
+  std::atomic<uint32_t> version;
+  std::atomic<uint32_t> states[max_clients];
+  char names[max_clients][max_name];
+};
+
+struct ClientHeader {
+  uint32_t version;
+  char model[max_path];
+  // fixed number of rows (i.e., agents) of every request
+  uint32_t rows;
+  uint32_t observation_size;
+  uint32_t action_size;
+  std::atomic<uint64_t> requested;
+  std::atomic<uint64_t> served;
+  // set by the daemon when it fails to serve the client
+  std::atomic<uint32_t> error;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+// Sizes of a client segment. The daemon validates and copies them when the
+// client registers and never reads them again from the shared header.
+struct Layout {
+  size_t rows;
+  size_t observation_size;
+  size_t action_size;
+
+  size_t slot_size() const { return rows * (observation_size + action_size); }
+
+  size_t segment_size() const {
+    return sizeof(ClientHeader) + ring_size * slot_size() * sizeof(float);
+  }
+
+  float *observations(ClientHeader *header, uint64_t request) const {
+    auto *data = reinterpret_cast<float *>(header + 1);
+    return data + (request % ring_size) * slot_size();
+  }
+
+  float *actions(ClientHeader *header, uint64_t request) const {
+    return observations(header, request) + rows * observation_size;
+  }
+};
+
+inline bool is_valid(const Layout &layout) {
+  return layout.rows > 0 && layout.rows <= max_rows &&
+         layout.observation_size > 0 &&
+         layout.observation_size <= max_observation_size &&
+         layout.action_size > 0 && layout.action_size <= max_action_size;
+}
+
+inline std::string registry_name(const std::string &name) {
+  return "/" + name;
+}
+
+} // namespace navground::onnx::shm
+
+#endif // NAVGROUND_ONNX_SHM_PROTOCOL_H_
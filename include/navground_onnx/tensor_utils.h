@@ -11,8 +11,17 @@
 
 namespace navground::onnx {
 
+// Wraps the buffer data in a tensor, optionally with an additional
+// leading batch dimension of size 1
 NAVGROUND_ONNX_EXPORT
-Ort::Value make_tensor(const core::Buffer &buffer);
+Ort::Value make_tensor(const core::Buffer &buffer,
+                       bool add_batch_dimension = false);
+
+// Wraps the slice `index` along `axis` of the buffer data, keeping the
+// axis with size 1. The slice must be contiguous: axes before `axis` should
+// have size 1.
+NAVGROUND_ONNX_EXPORT
+Ort::Value make_tensor(const core::Buffer &buffer, size_t axis, size_t index);
 
 } // namespace navground::onnx
 
@@ -0,0 +1,58 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#ifndef NAVGROUND_ONNX_THREAD_POOL_H_
+#define NAVGROUND_ONNX_THREAD_POOL_H_
+
+#include "navground_onnx/export.h"
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace navground::onnx {
+
+// A fixed set of threads that execute indexed tasks together with the caller
+class NAVGROUND_ONNX_EXPORT ThreadPool {
+public:
+  explicit ThreadPool(unsigned number_of_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Calls task(0), ..., task(number - 1) and returns when all have completed.
+  // Rethrows the first exception raised by a task. If the pool is already
+  // running tasks for another caller, the tasks run in the calling thread.
+  void run(size_t number, const std::function<void(size_t)> &task);
+
+  // The pool shared by all policies (one thread per core, caller included)
+  static ThreadPool &shared();
+
+private:
+  void work();
+  void consume();
+
+  std::vector<std::thread> _threads;
+  // held by the caller that is using the threads
+  std::mutex _caller;
+  std::mutex _mutex;
+  std::condition_variable _start;
+  std::condition_variable _done;
+  const std::function<void(size_t)> *_task;
+  size_t _size;
+  std::atomic<size_t> _next;
+  size_t _pending;
+  unsigned _active;
+  unsigned _generation;
+  bool _stop;
+  std::exception_ptr _exception;
+};
+
+} // namespace navground::onnx
+
+#endif // NAVGROUND_ONNX_THREAD_POOL_H_
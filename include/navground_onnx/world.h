@@ -0,0 +1,25 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#ifndef NAVGROUND_ONNX_WORLD_H_
+#define NAVGROUND_ONNX_WORLD_H_
+
+#include "navground/sim/world.h"
+#include "navground_onnx/world_export.h"
+
+namespace navground::onnx {
+
+// Updates the sensing of the agents of the world and runs inference for the
+// groups of their shared policies, so that agents then only read their
+// pre-computed actions, instead of running inference one at a time.
+NAVGROUND_ONNX_WORLD_EXPORT void update_shared_policies(sim::World &world);
+
+// Calls `update_shared_policies` at the end of each step of the world,
+// i.e., before the next step. The first step is not batched.
+NAVGROUND_ONNX_WORLD_EXPORT void
+add_shared_policies_callback(sim::World &world);
+
+} // namespace navground::onnx
+
+#endif // NAVGROUND_ONNX_WORLD_H_
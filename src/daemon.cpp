@@ -0,0 +1,258 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+// Serves inference requests from local processes through shared memory,
+// batching the requests for the same model in a single session run.
+//
+// Usage: navground_onnx_daemon [name]
+
+#include "navground_onnx/io_utils.h"
+#include "navground_onnx/shm_protocol.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <onnxruntime_cxx_api.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+namespace shm = navground::onnx::shm;
+
+static volatile std::sig_atomic_t running = 1;
+
+static void stop(int) { running = 0; }
+
+struct Client {
+  shm::ClientHeader *header;
+  // validated copy of the sizes in the header
+  shm::Layout layout;
+};
+
+struct Model {
+  std::unique_ptr<Ort::Session> session;
+  std::string input_name;
+  std::string output_name;
+  uint32_t observation_size;
+  uint32_t action_size;
+  std::vector<Client *> clients;
+  // the clients served by the current batch and their requests
+  std::vector<std::pair<Client *, uint64_t>> pending;
+  std::vector<float> observations;
+  std::vector<float> actions;
+};
+
+using ModelKey = std::tuple<std::string, size_t, size_t>;
+
+static std::unique_ptr<Model> load_model(Ort::Env &env,
+                                         const std::string &path,
+                                         const shm::Layout &layout) {
+  Ort::SessionOptions options;
+  options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+  options.SetIntraOpNumThreads(1);
+  auto model = std::make_unique<Model>();
+  {
+    SuppressStdErr s;
+    model->session = std::make_unique<Ort::Session>(env, path.c_str(), options);
+  }
+  Ort::AllocatorWithDefaultOptions allocator;
+  model->input_name =
+      model->session->GetInputNameAllocated(0, allocator).get();
+  model->output_name =
+      model->session->GetOutputNameAllocated(0, allocator).get();
+  model->observation_size = layout.observation_size;
+  model->action_size = layout.action_size;
+  return model;
+}
+
+// Runs a batch with one pending request of each client, returns whether
+// there was any. Clients can publish new requests at any time: the pending
+// requests are read once, so that the batch matches the buffers.
+static bool serve(Model &model) {
+  size_t rows = 0;
+  model.pending.clear();
+  for (auto *client : model.clients) {
+    const auto *header = client->header;
+    const uint64_t request = header->served.load(std::memory_order_relaxed);
+    if (header->requested.load(std::memory_order_acquire) > request) {
+      model.pending.emplace_back(client, request);
+      rows += client->layout.rows;
+    }
+  }
+  if (!rows) {
+    return false;
+  }
+  model.observations.resize(rows * model.observation_size);
+  model.actions.resize(rows * model.action_size);
+  auto *observations = model.observations.data();
+  for (const auto &[client, request] : model.pending) {
+    const auto n = client->layout.rows * model.observation_size;
+    std::memcpy(observations, client->layout.observations(client->header,
+                                                          request),
+                n * sizeof(float));
+    observations += n;
+  }
+  const auto memory_info =
+      Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+  const int64_t input_shape[] = {static_cast<int64_t>(rows),
+                                 model.observation_size};
+  const int64_t output_shape[] = {static_cast<int64_t>(rows),
+                                  model.action_size};
+  auto input = Ort::Value::CreateTensor<float>(
+      memory_info, model.observations.data(), model.observations.size(),
+      input_shape, 2);
+  auto output = Ort::Value::CreateTensor<float>(
+      memory_info, model.actions.data(), model.actions.size(), output_shape,
+      2);
+  const char *input_name = model.input_name.c_str();
+  const char *output_name = model.output_name.c_str();
+  model.session->Run(Ort::RunOptions{nullptr}, &input_name, &input, 1,
+                     &output_name, &output, 1);
+  const auto *actions = model.actions.data();
+  for (const auto &[client, request] : model.pending) {
+    const auto n = client->layout.rows * model.action_size;
+    std::memcpy(client->layout.actions(client->header, request), actions,
+                n * sizeof(float));
+    actions += n;
+    client->header->served.store(request + 1, std::memory_order_release);
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const std::string name = argc > 1 ? argv[1] : shm::default_name;
+  const auto registry_name = shm::registry_name(name);
+  shm_unlink(registry_name.c_str());
+  const int fd = shm_open(registry_name.c_str(), O_RDWR | O_CREAT | O_EXCL,
+                          0600);
+  if (fd < 0 || ftruncate(fd, sizeof(shm::Registry)) != 0) {
+    std::cerr << "Failed to create shared memory " << registry_name
+              << std::endl;
+    return 1;
+  }
+  void *data = mmap(nullptr, sizeof(shm::Registry), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Failed to map shared memory " << registry_name << std::endl;
+    return 1;
+  }
+  auto *registry = static_cast<shm::Registry *>(data);
+  std::signal(SIGINT, stop);
+  std::signal(SIGTERM, stop);
+
+  Ort::Env env(OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING, "Daemon");
+  std::map<ModelKey, std::unique_ptr<Model>> models;
+  std::unique_ptr<Client> clients[shm::max_clients];
+  registry->version.store(shm::version, std::memory_order_release);
+  std::cout << "Serving inference on " << registry_name << std::endl;
+
+  unsigned idle = 0;
+  while (running) {
+    for (size_t i = 0; i < shm::max_clients; ++i) {
+      const auto state = registry->states[i].load(std::memory_order_acquire);
+      if (state == shm::slot_ready && !clients[i]) {
+        const int segment_fd = shm_open(registry->names[i], O_RDWR, 0600);
+        if (segment_fd < 0) {
+          continue;
+        }
+        // map the header first to know the size of the segment, which must
+        // be large enough for the sizes requested by the client
+        struct stat info;
+        if (fstat(segment_fd, &info) != 0 ||
+            static_cast<size_t>(info.st_size) < sizeof(shm::ClientHeader)) {
+          close(segment_fd);
+          continue;
+        }
+        void *segment = mmap(nullptr, sizeof(shm::ClientHeader),
+                             PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+        if (segment == MAP_FAILED) {
+          close(segment_fd);
+          continue;
+        }
+        auto *header = static_cast<shm::ClientHeader *>(segment);
+        const shm::Layout layout{header->rows, header->observation_size,
+                                 header->action_size};
+        const std::string path(header->model,
+                               strnlen(header->model, shm::max_path));
+        if (header->version != shm::version || path.size() >= shm::max_path ||
+            !shm::is_valid(layout) ||
+            static_cast<size_t>(info.st_size) < layout.segment_size()) {
+          std::cerr << "Rejected client " << registry->names[i] << std::endl;
+          header->error.store(1);
+          munmap(segment, sizeof(shm::ClientHeader));
+          close(segment_fd);
+          // ignored until the client closes it
+          registry->states[i].store(shm::slot_claimed,
+                                    std::memory_order_release);
+          continue;
+        }
+        munmap(segment, sizeof(shm::ClientHeader));
+        segment = mmap(nullptr, layout.segment_size(), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, segment_fd, 0);
+        close(segment_fd);
+        if (segment == MAP_FAILED) {
+          continue;
+        }
+        header = static_cast<shm::ClientHeader *>(segment);
+        clients[i] = std::make_unique<Client>(Client{header, layout});
+        const ModelKey key{path, layout.observation_size,
+                           layout.action_size};
+        auto model = models.find(key);
+        if (model == models.end()) {
+          try {
+            model = models.emplace(key, load_model(env, path, layout)).first;
+          } catch (const std::exception &e) {
+            std::cerr << "Failed to load " << path << ": "
+                      << e.what() << std::endl;
+            header->error.store(1);
+            continue;
+          }
+        }
+        model->second->clients.push_back(clients[i].get());
+      } else if (state == shm::slot_closing) {
+        if (auto &client = clients[i]) {
+          for (auto &[_, model] : models) {
+            auto &cs = model->clients;
+            cs.erase(std::remove(cs.begin(), cs.end(), client.get()),
+                     cs.end());
+          }
+          munmap(client->header, client->layout.segment_size());
+          client.reset();
+        }
+        registry->states[i].store(shm::slot_empty, std::memory_order_release);
+      }
+    }
+    bool served = false;
+    for (auto &[_, model] : models) {
+      try {
+        served = serve(*model) || served;
+      } catch (const std::exception &e) {
+        std::cerr << "Inference failed: " << e.what() << std::endl;
+        for (auto *client : model->clients) {
+          client->header->error.store(1);
+        }
+      }
+    }
+    if (served) {
+      idle = 0;
+    } else if (++idle < 10000) {
+      std::this_thread::yield();
+    } else {
+      // nobody is stepping: stop busy waiting
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  registry->version.store(0);
+  munmap(registry, sizeof(shm::Registry));
+  shm_unlink(registry_name.c_str());
+  return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#include "navground_onnx/daemon_client.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+namespace navground::onnx {
+
+static void *map_segment(const std::string &name, size_t size, bool create) {
+  const int fd =
+      shm_open(name.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR,
+               0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+  if (create && ftruncate(fd, size) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  return data == MAP_FAILED ? nullptr : data;
+}
+
+DaemonClient::DaemonClient(const std::string &name,
+                           const std::filesystem::path &model, size_t rows,
+                           size_t observation_size, size_t action_size,
+                           std::chrono::milliseconds timeout)
+    : _registry(nullptr), _slot(0), _segment_name(), _header(nullptr),
+      _layout{rows, observation_size, action_size}, _timeout(timeout) {
+  if (!shm::is_valid(_layout)) {
+    throw std::runtime_error("Inference daemon does not support " +
+                             std::to_string(rows) + " rows of " +
+                             std::to_string(observation_size) +
+                             " observations and " +
+                             std::to_string(action_size) + " actions");
+  }
+  const auto model_path = model.string();
+  if (model_path.size() >= shm::max_path) {
+    throw std::runtime_error("Model path too long: " + model_path);
+  }
+  _registry = static_cast<shm::Registry *>(map_segment(
+      shm::registry_name(name), sizeof(shm::Registry), false));
+  if (!_registry || _registry->version.load() != shm::version) {
+    throw std::runtime_error("Inference daemon " + name + " is not running");
+  }
+  static std::atomic<unsigned> counter{0};
+  _segment_name = shm::registry_name(name) + "." + std::to_string(getpid()) +
+                  "." + std::to_string(counter++);
+  _header = static_cast<shm::ClientHeader *>(
+      map_segment(_segment_name, _layout.segment_size(), true));
+  if (!_header) {
+    munmap(_registry, sizeof(shm::Registry));
+    throw std::runtime_error("Failed to create shared memory " +
+                             _segment_name);
+  }
+  _header->version = shm::version;
+  std::strncpy(_header->model, model_path.c_str(), shm::max_path);
+  _header->rows = rows;
+  _header->observation_size = observation_size;
+  _header->action_size = action_size;
+  _header->requested = 0;
+  _header->served = 0;
+  _header->error = 0;
+  for (_slot = 0; _slot < shm::max_clients; ++_slot) {
+    uint32_t state = shm::slot_empty;
+    if (_registry->states[_slot].compare_exchange_strong(state,
+                                                         shm::slot_claimed)) {
+      std::strncpy(_registry->names[_slot], _segment_name.c_str(),
+                   shm::max_name - 1);
+      _registry->names[_slot][shm::max_name - 1] = '\0';
+      _registry->states[_slot].store(shm::slot_ready,
+                                     std::memory_order_release);
+      return;
+    }
+  }
+  munmap(_header, _layout.segment_size());
+  shm_unlink(_segment_name.c_str());
+  munmap(_registry, sizeof(shm::Registry));
+  throw std::runtime_error("Inference daemon " + name + " has no free slots");
+}
+
+DaemonClient::~DaemonClient() {
+  // the daemon releases the slot once it has unmapped the segment
+  _registry->states[_slot].store(shm::slot_closing, std::memory_order_release);
+  munmap(_header, _layout.segment_size());
+  shm_unlink(_segment_name.c_str());
+  munmap(_registry, sizeof(shm::Registry));
+}
+
+void DaemonClient::run(const ng_float_t *observations, ng_float_t *actions) {
+  const uint64_t request = _header->requested.load(std::memory_order_relaxed);
+  std::copy(observations,
+            observations + _layout.rows * _layout.observation_size,
+            _layout.observations(_header, request));
+  _header->requested.store(request + 1, std::memory_order_release);
+  // spin briefly, then yield, until the daemon has served the request
+  const auto deadline = std::chrono::steady_clock::now() + _timeout;
+  unsigned spins = 0;
+  while (_header->served.load(std::memory_order_acquire) <= request) {
+    if (_header->error.load(std::memory_order_relaxed)) {
+      throw std::runtime_error("Inference daemon failed to serve " +
+                               std::string(_header->model));
+    }
+    if (++spins < 1000) {
+      continue;
+    }
+    if (std::chrono::steady_clock::now() > deadline) {
+      throw std::runtime_error("Inference daemon is not responding");
+    }
+    std::this_thread::yield();
+  }
+  const float *values = _layout.actions(_header, request);
+  std::copy(values, values + _layout.rows * _layout.action_size, actions);
+}
+
+} // namespace navground::onnx
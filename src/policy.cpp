@@ -3,9 +3,13 @@
  */
 
 #include "navground_onnx/policy.h"
+#include "navground_onnx/preprocessing.h"
 #include "navground_onnx/tensor_utils.h"
 #include "navground_onnx/io_utils.h"
 #include <algorithm>
+#include <chrono>
+#include <set>
+#include <onnxruntime_session_options_config_keys.h>
 
 namespace navground::onnx {
 
@@ -31,8 +35,8 @@ void flatten(FlatBufferIterator &out,
     // std::cout << _ << std::endl;
     auto size = buffer.size();
     if (index >= 0) {
-      const auto shape = buffer.get_shape();
-      size /= shape[0];
+      // `get_shape` would return a copy
+      size /= buffer.get_description().shape[0];
     }
     std::visit(
         [&out, index, size](auto &&arg) {
@@ -48,9 +52,11 @@ void flatten(FlatBufferIterator &out,
   }
 }
 
-static std::vector<ng_float_t>
-compute_wheels(ng_float_t *values, ng_float_t max_value, size_t offset = 0) {
-  return {values[offset] * max_value, values[offset + 1] * max_value};
+static void compute_wheels(core::WheelSpeeds &speeds, ng_float_t *values,
+                           ng_float_t max_value, size_t offset = 0) {
+  speeds.resize(2);
+  speeds[0] = values[offset] * max_value;
+  speeds[1] = values[offset + 1] * max_value;
 }
 
 static core::Twist2 compute_value(ng_float_t *longitudinal,
@@ -72,18 +78,46 @@ static core::Twist2 compute_value(ng_float_t *longitudinal,
   return twist;
 }
 
+size_t Action::get_size(const ControlActionConfig &config) {
+  if (config.use_wheels) {
+    return 2;
+  }
+  return 1 + config.use_transversal + !config.fix_orientation;
+}
+
+void Action::bind(ng_float_t *data, const ControlActionConfig &config) {
+  wheels = longitudinal = transversal = angular = nullptr;
+  size = get_size(config);
+  if (config.use_wheels) {
+    wheels = data;
+    return;
+  }
+  longitudinal = data;
+  if (config.use_transversal) {
+    transversal = data + 1;
+  }
+  if (!config.fix_orientation) {
+    angular = data + size - 1;
+  }
+}
+
 core::Twist2 Action::get_cmd(const core::Behavior &behavior,
-                             ng_float_t time_step, size_t offset = 0) const {
+                             ng_float_t time_step, size_t index) const {
+  const size_t offset = index * size;
   if (wheels) {
     if (is_acceleration) {
-      const auto accs = compute_wheels(wheels, max_acceleration, offset);
-      auto speeds = behavior.get_wheel_speeds();
-      speeds[0] += accs[0] * time_step;
-      speeds[1] += accs[1] * time_step;
-      return behavior.twist_from_wheel_speeds(speeds);
+      // The twist is linear in the wheel speeds: integrating the wheel
+      // accelerations is the same as integrating the twist acceleration,
+      // which avoids `get_wheel_speeds` (returning a new vector).
+      compute_wheels(wheel_speeds, wheels, max_acceleration, offset);
+      const auto acc = behavior.twist_from_wheel_speeds(wheel_speeds);
+      const auto twist = behavior.get_twist(core::Frame::relative);
+      return core::Twist2(twist.velocity + time_step * acc.velocity,
+                          twist.angular_speed + time_step * acc.angular_speed,
+                          core::Frame::relative);
     }
-    const auto speeds = compute_wheels(wheels, max_speed, offset);
-    return behavior.twist_from_wheel_speeds(speeds);
+    compute_wheels(wheel_speeds, wheels, max_speed, offset);
+    return behavior.twist_from_wheel_speeds(wheel_speeds);
   }
   if (is_acceleration) {
     const auto acc =
@@ -145,16 +179,99 @@ void TargetState::update(const core::Behavior &behavior, size_t index = 0) {
   }
 }
 
+// Resets both buffers, so that the state stays reset if the row is later
+// restored from the output buffer.
+void RecurrentState::reset(size_t index) {
+  for (auto *buffer : buffers) {
+    auto data = const_cast<std::valarray<ng_float_t> *>(
+        buffer->get_data<ng_float_t>());
+    for (size_t i = 0; i < outer; ++i) {
+      auto begin = std::begin(*data) + (i * batches + index) * inner;
+      std::fill(begin, begin + inner, 0);
+    }
+  }
+}
+
+void RecurrentState::take_output(size_t index) {
+  const auto &source = *buffers[1 - current]->get_data<ng_float_t>();
+  auto &destination = *const_cast<std::valarray<ng_float_t> *>(
+      buffers[current]->get_data<ng_float_t>());
+  for (size_t i = 0; i < outer; ++i) {
+    const auto offset = (i * batches + index) * inner;
+    std::copy(std::begin(source) + offset, std::begin(source) + offset + inner,
+              std::begin(destination) + offset);
+  }
+}
+
+void RecurrentState::save(size_t index,
+                          std::vector<ng_float_t> &values) const {
+  const auto &source = *buffers[current]->get_data<ng_float_t>();
+  for (size_t i = 0; i < outer; ++i) {
+    const auto offset = (i * batches + index) * inner;
+    values.insert(values.end(), std::begin(source) + offset,
+                  std::begin(source) + offset + inner);
+  }
+}
+
+size_t RecurrentState::load(size_t index, const std::vector<ng_float_t> &values,
+                            size_t offset) {
+  for (auto *buffer : buffers) {
+    auto &destination = *const_cast<std::valarray<ng_float_t> *>(
+        buffer->get_data<ng_float_t>());
+    for (size_t i = 0; i < outer; ++i) {
+      std::copy(values.begin() + offset + i * inner,
+                values.begin() + offset + (i + 1) * inner,
+                std::begin(destination) + (i * batches + index) * inner);
+    }
+  }
+  return offset + outer * inner;
+}
+
+bool Policy::has_same_target(const core::Behavior &behavior,
+                             size_t index) const {
+  if (_recurrent_states.empty() || index >= _recurrent_targets.size()) {
+    return true;
+  }
+  const auto &target = behavior.get_target();
+  const auto &last = _recurrent_targets[index];
+  return last &&
+         *last == TargetKey{target.position, target.orientation,
+                            target.direction};
+}
+
+void Policy::update_recurrent_states(const core::Behavior &behavior,
+                                     size_t index) {
+  if (_recurrent_states.empty() || index >= _recurrent_targets.size()) {
+    return;
+  }
+  const auto &target = behavior.get_target();
+  const TargetKey key{target.position, target.orientation, target.direction};
+  auto &last = _recurrent_targets[index];
+  if (last && *last == key) {
+    return;
+  }
+  last = key;
+  for (auto &state : _recurrent_states) {
+    state.reset(index);
+  }
+}
+
 core::Twist2 Policy::get_cmd(const core::Behavior &behavior,
                              ng_float_t time_step) {
   if (!_initialized) {
     prepare(behavior);
   }
+  if (is_running()) {
+    skip();
+    return _action.get_cmd(behavior, time_step);
+  }
   _ego_state.update(behavior);
   _target_state.update(behavior);
+  update_recurrent_states(behavior, 0);
+  gather_sensing();
   if (observation_config.flat) {
     auto out = flat_buffer_interator();
-    flatten(out, get_sensing(behavior)->get_buffers());
+    flatten(out, _sensings[0]->get_buffers());
     flatten(out, _state_buffers);
   }
   run();
@@ -172,44 +289,285 @@ void Policy::run() {
     std::cerr << "Initialize the policy before running it!" << std::endl;
     return;
   }
-  _session->Run(Ort::RunOptions{nullptr}, _input_names.data(), _inputs.data(),
+  _stats.steps++;
+  for (const auto &stage : _preprocessing) {
+    stage.apply();
+  }
+  if (inference_config.latency_budget > 0) {
+    run_with_deadline();
+  } else {
+    run_inference();
+  }
+}
+
+void Policy::run_inference() {
+  if (_daemon_client) {
+    const auto observations = _flat_buffer.get_data<ng_float_t>();
+    auto actions = const_cast<std::valarray<ng_float_t> *>(
+        _action_buffer->get_data<ng_float_t>());
+    _daemon_client->run(&(*observations)[0], &(*actions)[0]);
+    return;
+  }
+  _session->Run(_run_options, _input_names.data(), _inputs.data(),
                 _inputs.size(), _output_names.data(), _outputs.data(),
                 _outputs.size());
+  // the states just computed become the next inputs
+  for (auto &state : _recurrent_states) {
+    std::swap(_inputs[state.input], _outputs[state.output]);
+    for (size_t i = 0; i < _row_inputs.size(); ++i) {
+      std::swap(_row_inputs[i][state.input], _row_outputs[i][state.output]);
+    }
+    state.current = 1 - state.current;
+  }
+}
+
+void Policy::run_row(size_t index) {
+  _stats.steps++;
+  for (const auto &stage : _preprocessing) {
+    stage.apply(index);
+  }
+  auto &inputs = _row_inputs.at(index);
+  auto &outputs = _row_outputs.at(index);
+  _session->Run(_run_options, _input_names.data(), inputs.data(),
+                inputs.size(), _output_names.data(), outputs.data(),
+                outputs.size());
+  // the other rows keep the states of the last batch inference
+  for (auto &state : _recurrent_states) {
+    state.take_output(index);
+  }
+}
+
+bool Policy::is_running() {
+  if (!_worker.joinable()) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (_running) {
+    return true;
+  }
+  if (_late) {
+    // the late inference has already advanced the recurrent states:
+    // its actions are adopted too
+    _late = false;
+    lock.unlock();
+    take_result();
+  }
+  return false;
+}
+
+void Policy::skip() {
+  _stats.steps++;
+  _stats.deadline_misses++;
+  apply_fallback();
+}
+
+void Policy::run_with_deadline() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _requested = true;
+  _running = true;
+  _cv.notify_all();
+  const std::chrono::duration<ng_float_t> budget(
+      inference_config.latency_budget);
+  if (!_cv.wait_for(lock, budget, [this] { return !_running; })) {
+    // the inference keeps running in the worker
+    _late = true;
+    lock.unlock();
+    _stats.deadline_misses++;
+    apply_fallback();
+    return;
+  }
+  lock.unlock();
+  take_result();
+}
+
+void Policy::take_result() {
+  if (_exception) {
+    std::exception_ptr exception;
+    std::swap(exception, _exception);
+    std::rethrow_exception(exception);
+  }
+  auto &actions = *const_cast<std::valarray<ng_float_t> *>(
+      _actions.get_data<ng_float_t>());
+  actions = *_action_buffer->get_data<ng_float_t>();
+}
+
+void Policy::apply_fallback() {
+  auto &actions = *const_cast<std::valarray<ng_float_t> *>(
+      _actions.get_data<ng_float_t>());
+  switch (inference_config.fallback) {
+  case Fallback::last:
+    break;
+  case Fallback::decay:
+    actions *= inference_config.fallback_decay;
+    break;
+  case Fallback::zero:
+    actions = 0;
+    break;
+  }
+}
+
+void Policy::work() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (;;) {
+    _cv.wait(lock, [this] { return _requested || _stop; });
+    if (_stop) {
+      return;
+    }
+    _requested = false;
+    lock.unlock();
+    std::exception_ptr exception;
+    try {
+      run_inference();
+    } catch (...) {
+      exception = std::current_exception();
+    }
+    lock.lock();
+    _exception = exception;
+    _running = false;
+    _cv.notify_all();
+  }
+}
+
+Policy::~Policy() {
+  if (_worker.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _cv.notify_all();
+    _worker.join();
+  }
+}
+
+// The env (and the allocator registered in it) and the pre-packed weights
+// live as long as at least one policy is alive. Policies may be constructed
+// concurrently, e.g., by parallel runs: creating the env and registering
+// the allocator must happen once.
+static std::shared_ptr<Ort::Env> get_shared_env() {
+  static std::mutex mutex;
+  static std::weak_ptr<Ort::Env> env;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto value = env.lock();
+  if (!value) {
+    value = std::make_shared<Ort::Env>(
+        OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING, "Default");
+    const Ort::MemoryInfo memory_info =
+        Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+    // default arena parameters
+    const Ort::ArenaCfg arena_cfg(0, -1, -1, -1);
+    value->CreateAndRegisterAllocator(memory_info, arena_cfg);
+    env = value;
+  }
+  return value;
+}
+
+static std::shared_ptr<Ort::PrePackedWeightsContainer>
+get_shared_prepacked_weights() {
+  static std::mutex mutex;
+  static std::weak_ptr<Ort::PrePackedWeightsContainer> container;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto value = container.lock();
+  if (!value) {
+    value = std::make_shared<Ort::PrePackedWeightsContainer>();
+    container = value;
+  }
+  return value;
 }
 
 Policy::Policy(const ControlActionConfig &action_config,
                const DefaultObservationConfig &observation_config,
-               const std::filesystem::path &path)
+               const std::filesystem::path &path,
+               const InferenceConfig &inference_config)
     : action_config(action_config), observation_config(observation_config),
-      path(path), _action(), _target_state(), _ego_state(), _state_buffers(),
-      _initialized(false),
-      _env(OrtLoggingLevel::ORT_LOGGING_LEVEL_WARNING, "Default"),
-      _session(nullptr) {
+      inference_config(inference_config), path(path), _action(),
+      _target_state(), _ego_state(), _state_buffers(), _sensings(),
+      _initialized(false), _batches(0), _stats(), _action_buffer(nullptr),
+      _run_options(), _env(nullptr), _prepacked_weights(nullptr),
+      _session(nullptr), _daemon_client(nullptr),
+      _actions(), _worker(), _mutex(), _cv(), _requested(false),
+      _running(false), _late(false), _stop(false), _exception() {
+  if (!inference_config.daemon.empty()) {
+    // the daemon loads the model
+    return;
+  }
+  _env = get_shared_env();
+  _prepacked_weights = get_shared_prepacked_weights();
   Ort::SessionOptions sessionOptions;
   sessionOptions.SetGraphOptimizationLevel(
       GraphOptimizationLevel::ORT_ENABLE_ALL);
   sessionOptions.SetIntraOpNumThreads(1);
+  sessionOptions.AddConfigEntry(kOrtSessionOptionsConfigUseEnvAllocators, "1");
   SuppressStdErr s;
-  _session = std::make_unique<Ort::Session>(_env, path.c_str(), sessionOptions);
+  const size_t memory = get_resident_memory();
+  _session = std::make_unique<Ort::Session>(*_env, path.c_str(), sessionOptions,
+                                            *_prepacked_weights);
+  _stats.session_memory = std::max(get_resident_memory(), memory) - memory;
 }
 
 int64_t Policy::get_number_of_batches() const { return 1; }
 
+void Policy::reset() {
+  if (_worker.joinable()) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return !_running; });
+    _late = false;
+    _exception = nullptr;
+  }
+  _inputs.clear();
+  _input_names.clear();
+  _outputs.clear();
+  _output_names.clear();
+  _row_inputs.clear();
+  _row_outputs.clear();
+  _output_buffers.clear();
+  _action_buffer = nullptr;
+  _state_buffers.clear();
+  _sensing_buffers.clear();
+  _sensing_gathers.clear();
+  _recurrent_buffers.clear();
+  _recurrent_states.clear();
+  _recurrent_targets.clear();
+  _preprocessing.clear();
+  _daemon_client.reset();
+  _flat_buffer = core::Buffer();
+  _actions = core::Buffer();
+  _action = Action();
+  _target_state = TargetState();
+  _ego_state = EgoState();
+  _initialized = false;
+}
+
 void Policy::prepare(const core::Behavior &behavior) {
+  if (_initialized) {
+    reset();
+  }
   int64_t batches = get_number_of_batches();
+  _batches = batches;
   // std::cout << "Policy::prepare " << batches << std::endl;
   _target_state.max_speed = behavior.get_max_speed();
   _target_state.max_angular_speed = behavior.get_angular_speed();
   _target_state.max_distance = behavior.get_horizon();
-  auto *out_ptr =
-      add_buffer<ng_float_t>(_output_buffers, "action", {batches, 2});
-  _action.longitudinal = out_ptr;
-  _action.angular = out_ptr + 1;
+  const int64_t action_size = Action::get_size(action_config);
+  _action.bind(add_buffer<ng_float_t>(_output_buffers, "action",
+                                      {batches, action_size}),
+               action_config);
+  _action_buffer = &_output_buffers.at("action");
   _action.max_speed = behavior.get_max_speed();
   _action.max_angular_speed = behavior.get_max_angular_speed();
   _action.is_acceleration = action_config.use_acceleration_action;
   _action.max_acceleration = action_config.max_acceleration;
   _action.max_angular_acceleration = action_config.max_angular_acceleration;
+  _action.wheel_speeds.reserve(2);
+  if (inference_config.latency_budget > 0) {
+    _actions = core::Buffer(
+        core::BufferDescription::make<ng_float_t>({batches, action_size}));
+    _action.bind(
+        const_cast<ng_float_t *>(&((*_actions.get_data<ng_float_t>())[0])),
+        action_config);
+    if (!_worker.joinable()) {
+      _worker = std::thread(&Policy::work, this);
+    }
+  }
 
   if (observation_config.include_target_direction) {
     _target_state.direction = add_buffer<ng_float_t>(
@@ -248,10 +606,13 @@ void Policy::prepare(const core::Behavior &behavior) {
     _target_state.angular_speed = add_buffer<ng_float_t>(
         _state_buffers, "ego_target_angular_speed", {batches, 1});
   }
-  const auto _env_state = get_sensing(behavior);
+  if (_sensings.empty()) {
+    _sensings.push_back(get_sensing(behavior));
+  }
+  const auto preprocessing = load_preprocessing(path, _session.get());
   if (observation_config.flat) {
     int64_t obs_size = 0;
-    for (const auto &[_, buffer] : _env_state->get_buffers()) {
+    for (const auto &[_, buffer] : _sensings[0]->get_buffers()) {
       obs_size += buffer.size();
     }
     for (const auto &[_, buffer] : _state_buffers) {
@@ -259,12 +620,32 @@ void Policy::prepare(const core::Behavior &behavior) {
     }
     _flat_buffer = core::Buffer(
         core::BufferDescription::make<ng_float_t>({batches, obs_size}));
+    if (!inference_config.daemon.empty()) {
+      _daemon_client = std::make_unique<DaemonClient>(
+          inference_config.daemon, path, batches, obs_size, action_size);
+      prepare_preprocessing(preprocessing, batches);
+      _initialized = true;
+      return;
+    }
     _inputs.emplace_back(make_tensor(_flat_buffer));
     _input_names.push_back("observation");
   } else {
-    for (const auto &[key, buffer] : _env_state->get_buffers()) {
-      _inputs.emplace_back(make_tensor(buffer));
-      _input_names.push_back(key.c_str());
+    if (!inference_config.daemon.empty()) {
+      throw std::runtime_error(
+          "Inference in the daemon requires flat observations");
+    }
+    if (_sensings.size() == 1 && preprocessing.empty()) {
+      // bind the buffers of the only behavior
+      for (const auto &[key, buffer] : _sensings[0]->get_buffers()) {
+        _inputs.emplace_back(make_tensor(buffer, true));
+        _input_names.push_back(key.c_str());
+      }
+    } else {
+      prepare_sensing_gathers(batches);
+      for (const auto &[key, buffer] : _sensing_buffers) {
+        _inputs.emplace_back(make_tensor(buffer));
+        _input_names.push_back(key.c_str());
+      }
     }
     for (const auto &[key, buffer] : _state_buffers) {
       _inputs.emplace_back(make_tensor(buffer));
@@ -275,7 +656,391 @@ void Policy::prepare(const core::Behavior &behavior) {
     _outputs.emplace_back(make_tensor(buffer));
     _output_names.push_back(key.c_str());
   }
+  prepare_recurrent_states(batches);
+  validate_bindings();
+  prepare_preprocessing(preprocessing, batches);
+  prepare_row_bindings(batches);
   _initialized = true;
 }
 
+static std::string to_string(const std::vector<int64_t> &shape) {
+  std::string text = "{";
+  for (size_t i = 0; i < shape.size(); ++i) {
+    text += (i ? ", " : "") + std::to_string(shape[i]);
+  }
+  return text + "}";
+}
+
+static std::string to_string(ONNXTensorElementDataType type) {
+  switch (type) {
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT:
+    return "float";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_DOUBLE:
+    return "double";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16:
+    return "float16";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_BFLOAT16:
+    return "bfloat16";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8:
+    return "int8";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT16:
+    return "int16";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32:
+    return "int32";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64:
+    return "int64";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8:
+    return "uint8";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT16:
+    return "uint16";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT32:
+    return "uint32";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT64:
+    return "uint64";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_BOOL:
+    return "bool";
+  case ONNX_TENSOR_ELEMENT_DATA_TYPE_STRING:
+    return "string";
+  default:
+    return "type " + std::to_string(type);
+  }
+}
+
+// Checks that the tensors bound to `names` match the model inputs (or
+// outputs) in name, element type and shape, where the model dynamic axes
+// match any size. If `complete`, all model tensors must be bound.
+static void check_bindings(const std::string &kind,
+                           const std::vector<std::string> &model_names,
+                           const std::vector<Ort::TypeInfo> &model_types,
+                           const std::vector<const char *> &names,
+                           const std::vector<Ort::Value> &values,
+                           bool complete) {
+  std::string available;
+  for (const auto &name : model_names) {
+    available += (available.empty() ? "" : ", ") + name;
+  }
+  for (size_t j = 0; j < names.size(); ++j) {
+    const auto i = static_cast<size_t>(
+        std::find(model_names.begin(), model_names.end(), names[j]) -
+        model_names.begin());
+    if (i == model_names.size()) {
+      throw std::runtime_error("The model has no " + kind + " " + names[j] +
+                               " (" + kind + "s: " + available + ")");
+    }
+    const auto expected = model_types[i].GetTensorTypeAndShapeInfo();
+    const auto actual = values[j].GetTensorTypeAndShapeInfo();
+    if (expected.GetElementType() != actual.GetElementType()) {
+      throw std::runtime_error(
+          "The model " + kind + " " + names[j] + " has element type " +
+          to_string(expected.GetElementType()) + " instead of " +
+          to_string(actual.GetElementType()));
+    }
+    const auto expected_shape = expected.GetShape();
+    const auto actual_shape = actual.GetShape();
+    bool match = expected_shape.size() == actual_shape.size();
+    for (size_t k = 0; match && k < expected_shape.size(); ++k) {
+      match = expected_shape[k] < 0 || expected_shape[k] == actual_shape[k];
+    }
+    if (!match) {
+      throw std::runtime_error("The model " + kind + " " + names[j] +
+                               " has shape " + to_string(expected_shape) +
+                               " instead of " + to_string(actual_shape));
+    }
+  }
+  if (complete) {
+    for (const auto &name : model_names) {
+      if (std::find_if(names.begin(), names.end(), [&name](const char *n) {
+            return name == n;
+          }) == names.end()) {
+        throw std::runtime_error("The model " + kind + " " + name +
+                                 " is not provided by the configuration");
+      }
+    }
+  }
+}
+
+// Runs once at preparation, so that a mismatch between the configuration
+// and the model fails fast instead of inside the first `Run`.
+void Policy::validate_bindings() const {
+  if (!_session) {
+    return;
+  }
+  Ort::AllocatorWithDefaultOptions allocator;
+  std::vector<std::string> names;
+  std::vector<Ort::TypeInfo> types;
+  for (size_t i = 0; i < _session->GetInputCount(); ++i) {
+    names.emplace_back(_session->GetInputNameAllocated(i, allocator).get());
+    types.push_back(_session->GetInputTypeInfo(i));
+  }
+  check_bindings("input", names, types, _input_names, _inputs, true);
+  names.clear();
+  types.clear();
+  for (size_t i = 0; i < _session->GetOutputCount(); ++i) {
+    names.emplace_back(_session->GetOutputNameAllocated(i, allocator).get());
+    types.push_back(_session->GetOutputTypeInfo(i));
+  }
+  check_bindings("output", names, types, _output_names, _outputs, false);
+}
+
+void Policy::prepare_preprocessing(const Preprocessing &preprocessing,
+                                   int64_t batches) {
+  for (const auto &[name, transform] : preprocessing) {
+    core::Buffer *buffer = nullptr;
+    if (observation_config.flat) {
+      if (name == "observation") {
+        buffer = &_flat_buffer;
+      }
+    } else if (_sensing_buffers.count(name)) {
+      buffer = &_sensing_buffers.at(name);
+    } else if (_state_buffers.count(name)) {
+      buffer = &_state_buffers.at(name);
+    }
+    if (!buffer) {
+      throw std::runtime_error("Cannot preprocess unknown input " + name);
+    }
+    auto data = const_cast<std::valarray<ng_float_t> *>(
+        buffer->get_data<ng_float_t>());
+    if (!data) {
+      throw std::runtime_error("Cannot preprocess non-float input " + name);
+    }
+    PreprocessingStage stage{&(*data)[0], static_cast<size_t>(batches),
+                             transform};
+    stage.transform.fit(buffer->size() / batches);
+    _preprocessing.push_back(std::move(stage));
+  }
+}
+
+void SensingGather::update() const {
+  std::visit(
+      [this](auto &&arg) {
+        using Q = std::remove_reference_t<decltype(arg[0])>;
+        using T = std::remove_const_t<Q>;
+        auto out = std::begin(const_cast<std::valarray<T> &>(arg));
+        for (const auto *source : sources) {
+          const auto *data = source->get_data<T>();
+          out = std::copy(std::begin(*data), std::end(*data), out);
+        }
+      },
+      destination->get_data_container());
+}
+
+void SensingGather::update(size_t index) const {
+  std::visit(
+      [this, index](auto &&arg) {
+        using Q = std::remove_reference_t<decltype(arg[0])>;
+        using T = std::remove_const_t<Q>;
+        const auto *data = sources[index]->get_data<T>();
+        std::copy(std::begin(*data), std::end(*data),
+                  std::begin(const_cast<std::valarray<T> &>(arg)) +
+                      index * data->size());
+      },
+      destination->get_data_container());
+}
+
+void Policy::gather_sensing() const {
+  for (const auto &gather : _sensing_gathers) {
+    gather.update();
+  }
+}
+
+void Policy::gather_sensing(size_t index) const {
+  for (const auto &gather : _sensing_gathers) {
+    gather.update(index);
+  }
+}
+
+// Allocates a `{batches, ...}` buffer for each sensing buffer and resolves,
+// once, the buffers of all behaviors that are copied into it at each step.
+void Policy::prepare_sensing_gathers(int64_t batches) {
+  for (const auto &[key, buffer] : _sensings[0]->get_buffers()) {
+    auto description = buffer.get_description();
+    description.shape.insert(description.shape.begin(), batches);
+    auto &batched = _sensing_buffers.emplace(key, description).first->second;
+    SensingGather gather{&batched, {}};
+    for (auto *sensing : _sensings) {
+      const auto &buffers = sensing->get_buffers();
+      const auto source = buffers.find(key);
+      if (source == buffers.end() ||
+          source->second.get_description().type != description.type ||
+          source->second.size() != buffer.size()) {
+        throw std::runtime_error("Sensing buffer " + key +
+                                 " differs between behaviors");
+      }
+      gather.sources.push_back(&source->second);
+    }
+    _sensing_gathers.push_back(std::move(gather));
+  }
+}
+
+static const std::string recurrent_input_suffix = "_in";
+static const std::string recurrent_output_suffix = "_out";
+
+// Pairs the configured recurrent inputs and outputs or, if none are
+// configured, outputs `<name>_out` with inputs `<name>_in` or `<name>`.
+std::vector<std::pair<std::string, std::string>>
+Policy::get_recurrent_pairs() const {
+  Ort::AllocatorWithDefaultOptions allocator;
+  std::set<std::string> inputs;
+  for (size_t i = 0; i < _session->GetInputCount(); ++i) {
+    inputs.insert(_session->GetInputNameAllocated(i, allocator).get());
+  }
+  std::set<std::string> outputs;
+  for (size_t i = 0; i < _session->GetOutputCount(); ++i) {
+    outputs.insert(_session->GetOutputNameAllocated(i, allocator).get());
+  }
+  std::vector<std::pair<std::string, std::string>> pairs;
+  const auto &config_inputs = inference_config.recurrent_inputs;
+  const auto &config_outputs = inference_config.recurrent_outputs;
+  if (!config_inputs.empty() || !config_outputs.empty()) {
+    if (config_inputs.size() != config_outputs.size()) {
+      throw std::runtime_error(
+          "Recurrent inputs and outputs have different lengths");
+    }
+    for (size_t i = 0; i < config_inputs.size(); ++i) {
+      if (!inputs.count(config_inputs[i])) {
+        throw std::runtime_error("Model has no recurrent input " +
+                                 config_inputs[i]);
+      }
+      if (!outputs.count(config_outputs[i])) {
+        throw std::runtime_error("Model has no recurrent output " +
+                                 config_outputs[i]);
+      }
+      pairs.emplace_back(config_inputs[i], config_outputs[i]);
+    }
+    return pairs;
+  }
+  const auto n = recurrent_output_suffix.size();
+  for (const auto &output : outputs) {
+    if (output.size() <= n ||
+        output.compare(output.size() - n, n, recurrent_output_suffix) != 0) {
+      continue;
+    }
+    const auto name = output.substr(0, output.size() - n);
+    if (inputs.count(name + recurrent_input_suffix)) {
+      pairs.emplace_back(name + recurrent_input_suffix, output);
+    } else if (inputs.count(name)) {
+      pairs.emplace_back(name, output);
+    }
+  }
+  return pairs;
+}
+
+// The batch axis is the configured one or else the first dynamic axis.
+// A state without dynamic axes can only be used by a single behavior.
+static size_t get_batch_axis(const std::string &name,
+                             const std::vector<int64_t> &shape,
+                             int batch_axis, int64_t batches) {
+  if (shape.empty()) {
+    throw std::runtime_error("Recurrent state " + name + " is a scalar");
+  }
+  if (batch_axis >= 0) {
+    if (static_cast<size_t>(batch_axis) >= shape.size()) {
+      throw std::runtime_error("Recurrent state " + name +
+                               " has no axis " + std::to_string(batch_axis));
+    }
+    return batch_axis;
+  }
+  const auto i = std::find_if(shape.begin(), shape.end(),
+                              [](int64_t dim) { return dim < 0; });
+  if (i != shape.end()) {
+    return i - shape.begin();
+  }
+  const auto j = std::find(shape.begin(), shape.end(), 1);
+  if (batches > 1 || j == shape.end()) {
+    throw std::runtime_error("Cannot find the batch axis of recurrent state " +
+                             name + ": set recurrent_batch_axis");
+  }
+  return j - shape.begin();
+}
+
+void Policy::prepare_recurrent_states(int64_t batches) {
+  if (!_session) {
+    return;
+  }
+  Ort::AllocatorWithDefaultOptions allocator;
+  std::map<std::string, size_t> inputs;
+  for (size_t i = 0; i < _session->GetInputCount(); ++i) {
+    inputs.emplace(_session->GetInputNameAllocated(i, allocator).get(), i);
+  }
+  for (const auto &[input_name, output_name] : get_recurrent_pairs()) {
+    auto shape = _session->GetInputTypeInfo(inputs.at(input_name))
+                     .GetTensorTypeAndShapeInfo()
+                     .GetShape();
+    const size_t axis = get_batch_axis(
+        input_name, shape, inference_config.recurrent_batch_axis, batches);
+    shape[axis] = batches;
+    if (std::any_of(shape.begin(), shape.end(),
+                    [](int64_t dim) { return dim < 0; })) {
+      throw std::runtime_error("Recurrent state " + input_name +
+                               " has more than one dynamic axis");
+    }
+    const auto description = core::BufferDescription::make<ng_float_t>(
+        core::BufferShape(shape.begin(), shape.end()));
+    auto &in = *_recurrent_buffers.emplace(input_name, description).first;
+    auto &out = *_recurrent_buffers.emplace(output_name, description).first;
+    RecurrentState state;
+    state.buffers[0] = &in.second;
+    state.buffers[1] = &out.second;
+    state.input = _inputs.size();
+    state.output = _outputs.size();
+    state.current = 0;
+    state.axis = axis;
+    state.outer = 1;
+    state.batches = batches;
+    state.inner = 1;
+    for (size_t j = 0; j < shape.size(); ++j) {
+      if (j < axis) {
+        state.outer *= shape[j];
+      } else if (j > axis) {
+        state.inner *= shape[j];
+      }
+    }
+    _inputs.emplace_back(make_tensor(in.second));
+    _input_names.push_back(in.first.c_str());
+    _outputs.emplace_back(make_tensor(out.second));
+    _output_names.push_back(out.first.c_str());
+    _recurrent_states.push_back(state);
+  }
+  _recurrent_targets.assign(batches, std::nullopt);
+}
+
+// Binds, for each batch row, tensors to the row slices of the batched
+// buffers. Not available when a slice is not contiguous, i.e., when a
+// recurrent state has non-trivial axes before the batch axis.
+void Policy::prepare_row_bindings(int64_t batches) {
+  if (batches < 2 || !_session || inference_config.latency_budget > 0) {
+    return;
+  }
+  std::map<std::string, std::pair<const core::Buffer *, size_t>> slices;
+  slices.emplace("observation", std::make_pair(&_flat_buffer, 0));
+  for (const auto *buffers :
+       {&_sensing_buffers, &_state_buffers, &_output_buffers}) {
+    for (const auto &[key, buffer] : *buffers) {
+      slices.emplace(key, std::make_pair(&buffer, 0));
+    }
+  }
+  for (const auto &state : _recurrent_states) {
+    if (state.outer != 1) {
+      return;
+    }
+    for (const auto &[key, buffer] : _recurrent_buffers) {
+      if (&buffer == state.buffers[0] || &buffer == state.buffers[1]) {
+        slices.emplace(key, std::make_pair(&buffer, state.axis));
+      }
+    }
+  }
+  _row_inputs.resize(batches);
+  _row_outputs.resize(batches);
+  for (int64_t i = 0; i < batches; ++i) {
+    for (const auto *name : _input_names) {
+      const auto &[buffer, axis] = slices.at(name);
+      _row_inputs[i].emplace_back(make_tensor(*buffer, axis, i));
+    }
+    for (const auto *name : _output_names) {
+      const auto &[buffer, axis] = slices.at(name);
+      _row_outputs[i].emplace_back(make_tensor(*buffer, axis, i));
+    }
+  }
+}
+
 } // namespace navground::onnx
@@ -5,6 +5,7 @@
 #include "navground_onnx/policy_behavior.h"
 #include "navground/core/property.h"
 #include "navground_onnx/shared_policy.h"
+#include <stdexcept>
 
 namespace navground::onnx {
 
@@ -18,10 +19,14 @@ void PolicyBehavior::prepare() {
   if (!_policy) {
     if (get_shared()) {
       _policy = SharedPolicy::join(*this, action_config, observation_config,
-                                   _policy_path);
+                                   _policy_path, inference_config);
+    } else if (get_auto_shared()) {
+      _policy = SharedPolicy::join_auto(*this, action_config,
+                                        observation_config, _policy_path,
+                                        inference_config);
     } else {
       _policy = std::make_shared<Policy>(action_config, observation_config,
-                                         _policy_path);
+                                         _policy_path, inference_config);
       _policy->prepare(*this);
     }
   }
@@ -30,13 +35,35 @@ void PolicyBehavior::prepare() {
 core::Twist2 PolicyBehavior::compute_cmd_internal(ng_float_t time_step) {
   if (!_policy) {
     prepare();
-    if (get_shared()) {
-      return core::Twist2();
-    }
   }
   return feasible_twist(_policy->get_cmd(*this, time_step));
 }
 
+static std::string fallback_to_string(Fallback value) {
+  switch (value) {
+  case Fallback::decay:
+    return "decay";
+  case Fallback::zero:
+    return "zero";
+  default:
+    return "last";
+  }
+}
+
+static Fallback fallback_from_string(const std::string &value) {
+  if (value == "decay") {
+    return Fallback::decay;
+  }
+  if (value == "zero") {
+    return Fallback::zero;
+  }
+  if (value == "last") {
+    return Fallback::last;
+  }
+  throw std::runtime_error("Unknown fallback " + value +
+                           ": use \"last\", \"decay\", or \"zero\"");
+}
+
 const std::string PolicyBehavior::type = register_type<PolicyBehavior>(
     "CppPolicy",
     {
@@ -44,10 +71,88 @@ const std::string PolicyBehavior::type = register_type<PolicyBehavior>(
          core::Property::make(
              &PolicyBehavior::get_shared, &PolicyBehavior::set_shared, false,
              "Whether to share the policy with similar agents")},
+        {"auto_shared",
+         core::Property::make(
+             &PolicyBehavior::get_auto_shared,
+             &PolicyBehavior::set_auto_shared, false,
+             "Whether, when not shared, to batch inference with agents that "
+             "use the same model and configuration")},
         {"policy_path",
          core::Property::make(&PolicyBehavior::get_policy_path_as_string,
                               &PolicyBehavior::set_policy_path_as_string,
                               std::string(""), "Path to the onnx model")},
+        {"daemon", core::Property::make<std::string, PolicyBehavior>(
+                       [](const PolicyBehavior *b) -> std::string {
+                         return b->inference_config.daemon;
+                       },
+                       [](PolicyBehavior *b, const std::string &value) {
+                         b->inference_config.daemon = value;
+                       },
+                       std::string(""),
+                       "Name of the local inference daemon (empty to run "
+                       "inference in-process)")},
+        {"latency_budget",
+         core::Property::make<ng_float_t, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> ng_float_t {
+               return b->inference_config.latency_budget;
+             },
+             [](PolicyBehavior *b, ng_float_t value) {
+               b->inference_config.latency_budget = value;
+             },
+             0, "Maximal time to wait for inference [s] (0 to always wait)")},
+        {"fallback",
+         core::Property::make<std::string, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> std::string {
+               return fallback_to_string(b->inference_config.fallback);
+             },
+             [](PolicyBehavior *b, const std::string &value) {
+               b->inference_config.fallback = fallback_from_string(value);
+             },
+             std::string("last"),
+             "Action used when inference misses the deadline: "
+             "\"last\", \"decay\", or \"zero\"")},
+        {"fallback_decay",
+         core::Property::make<ng_float_t, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> ng_float_t {
+               return b->inference_config.fallback_decay;
+             },
+             [](PolicyBehavior *b, ng_float_t value) {
+               b->inference_config.fallback_decay = value;
+             },
+             0.5, "Factor applied to the last action at each missed deadline "
+                  "when fallback is \"decay\"")},
+        {"recurrent_inputs",
+         core::Property::make<std::vector<std::string>, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> std::vector<std::string> {
+               return b->inference_config.recurrent_inputs;
+             },
+             [](PolicyBehavior *b, const std::vector<std::string> &value) {
+               b->inference_config.recurrent_inputs = value;
+             },
+             std::vector<std::string>{},
+             "Names of the recurrent inputs (empty to use the naming "
+             "convention)")},
+        {"recurrent_outputs",
+         core::Property::make<std::vector<std::string>, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> std::vector<std::string> {
+               return b->inference_config.recurrent_outputs;
+             },
+             [](PolicyBehavior *b, const std::vector<std::string> &value) {
+               b->inference_config.recurrent_outputs = value;
+             },
+             std::vector<std::string>{},
+             "Names of the recurrent outputs, paired with the recurrent "
+             "inputs")},
+        {"recurrent_batch_axis",
+         core::Property::make<int, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> int {
+               return b->inference_config.recurrent_batch_axis;
+             },
+             [](PolicyBehavior *b, int value) {
+               b->inference_config.recurrent_batch_axis = value;
+             },
+             -1, "Batch axis of the recurrent states (negative to use the "
+                 "first dynamic axis)")},
         {"use_acceleration_action",
          core::Property::make<bool, PolicyBehavior>(
              [](const PolicyBehavior *b) -> bool {
@@ -57,6 +162,35 @@ const std::string PolicyBehavior::type = register_type<PolicyBehavior>(
                b->action_config.use_acceleration_action = value;
              },
              false, "Whether actions are accelerations.")},
+        {"use_wheels",
+         core::Property::make<bool, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> bool {
+               return b->action_config.use_wheels;
+             },
+             [](PolicyBehavior *b, bool value) {
+               b->action_config.use_wheels = value;
+             },
+             false, "Whether actions are wheel speeds.")},
+        {"use_transversal",
+         core::Property::make<bool, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> bool {
+               return b->action_config.use_transversal;
+             },
+             [](PolicyBehavior *b, bool value) {
+               b->action_config.use_transversal = value;
+             },
+             false,
+             "Whether actions include the transversal speed "
+             "(for holonomic agents).")},
+        {"fix_orientation",
+         core::Property::make<bool, PolicyBehavior>(
+             [](const PolicyBehavior *b) -> bool {
+               return b->action_config.fix_orientation;
+             },
+             [](PolicyBehavior *b, bool value) {
+               b->action_config.fix_orientation = value;
+             },
+             false, "Whether actions do not include the angular speed.")},
         {"max_acceleration", core::Property::make<ng_float_t, PolicyBehavior>(
                                  [](const PolicyBehavior *b) -> bool {
                                    return b->action_config.max_acceleration;
@@ -0,0 +1,148 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#include "navground_onnx/preprocessing.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <yaml-cpp/yaml.h>
+
+namespace navground::onnx {
+
+static void fit_field(std::vector<ng_float_t> &values, size_t features,
+                      ng_float_t default_value, const char *name) {
+  if (values.empty()) {
+    values.assign(features, default_value);
+  } else if (values.size() == 1) {
+    values.assign(features, values[0]);
+  } else if (values.size() != features) {
+    throw std::runtime_error(std::string("Preprocessing ") + name + " has " +
+                             std::to_string(values.size()) +
+                             " values instead of " + std::to_string(features));
+  }
+}
+
+void FeatureTransform::fit(size_t features) {
+  const auto inf = std::numeric_limits<ng_float_t>::infinity();
+  fit_field(low, features, -inf, "low");
+  fit_field(high, features, inf, "high");
+  fit_field(scale, features, 1, "scale");
+  fit_field(offset, features, 0, "offset");
+}
+
+void PreprocessingStage::apply() const { apply(0, rows); }
+
+void PreprocessingStage::apply(size_t row) const { apply(row, row + 1); }
+
+// The data does not alias the parameters: a single pass with no branches,
+// which the compiler vectorizes (see `CMakeLists.txt`)
+static void transform_rows(ng_float_t *__restrict x, size_t rows, size_t n,
+                           const ng_float_t *__restrict low,
+                           const ng_float_t *__restrict high,
+                           const ng_float_t *__restrict scale,
+                           const ng_float_t *__restrict offset) {
+  for (size_t i = 0; i < rows; ++i, x += n) {
+    for (size_t j = 0; j < n; ++j) {
+      x[j] = std::min(std::max(x[j], low[j]), high[j]) * scale[j] + offset[j];
+    }
+  }
+}
+
+void PreprocessingStage::apply(size_t begin, size_t end) const {
+  const size_t n = transform.scale.size();
+  transform_rows(data + begin * n, end - begin, n, transform.low.data(),
+                 transform.high.data(), transform.scale.data(),
+                 transform.offset.data());
+}
+
+// Reads a number or a list of numbers, like `1` or `[1, 2.5, -.inf]`
+static std::vector<ng_float_t> read_values(const YAML::Node &node) {
+  if (node.IsSequence()) {
+    return node.as<std::vector<ng_float_t>>();
+  }
+  return {node.as<ng_float_t>()};
+}
+
+static std::vector<ng_float_t> *field(FeatureTransform &transform,
+                                      const std::string &name) {
+  if (name == "low") {
+    return &transform.low;
+  }
+  if (name == "high") {
+    return &transform.high;
+  }
+  if (name == "scale") {
+    return &transform.scale;
+  }
+  if (name == "offset") {
+    return &transform.offset;
+  }
+  return nullptr;
+}
+
+static bool is_field(const std::string &name) {
+  FeatureTransform transform;
+  return field(transform, name) != nullptr;
+}
+
+static void load_metadata(Preprocessing &preprocessing,
+                          const Ort::Session &session) {
+  static const std::string prefix = "preprocessing.";
+  Ort::AllocatorWithDefaultOptions allocator;
+  const auto metadata = session.GetModelMetadata();
+  for (const auto &key_ptr :
+       metadata.GetCustomMetadataMapKeysAllocated(allocator)) {
+    const std::string key = key_ptr.get();
+    const auto dot = key.rfind('.');
+    if (key.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    const auto name = key.substr(dot + 1);
+    if (dot < prefix.size() || !is_field(name)) {
+      throw std::runtime_error("Unknown preprocessing field " + key +
+                               " in model metadata");
+    }
+    const auto input = key.substr(prefix.size(), dot - prefix.size());
+    const auto value =
+        metadata.LookupCustomMetadataMapAllocated(key.c_str(), allocator);
+    *field(preprocessing[input], name) = read_values(YAML::Load(value.get()));
+  }
+}
+
+static void load_sidecar(Preprocessing &preprocessing,
+                         const std::filesystem::path &path) {
+  if (!std::filesystem::exists(path)) {
+    return;
+  }
+  const auto node = YAML::LoadFile(path.string());
+  if (!node.IsMap()) {
+    throw std::runtime_error("Preprocessing in " + path.string() +
+                             " is not a map");
+  }
+  for (const auto &item : node) {
+    const auto input = item.first.as<std::string>();
+    for (const auto &value : item.second) {
+      const auto key = value.first.as<std::string>();
+      if (!is_field(key)) {
+        throw std::runtime_error("Unknown preprocessing field " + key +
+                                 " in " + path.string());
+      }
+      *field(preprocessing[input], key) = read_values(value.second);
+    }
+  }
+}
+
+Preprocessing load_preprocessing(const std::filesystem::path &model,
+                                 const Ort::Session *session) {
+  Preprocessing preprocessing;
+  if (session) {
+    load_metadata(preprocessing, *session);
+  }
+  auto sidecar = model;
+  sidecar.replace_extension(".preprocessing.yaml");
+  load_sidecar(preprocessing, sidecar);
+  return preprocessing;
+}
+
+} // namespace navground::onnx
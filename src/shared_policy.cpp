@@ -3,7 +3,16 @@
  */
 
 #include "navground_onnx/shared_policy.h"
+#include "navground_onnx/policy_behavior.h"
+#include "navground_onnx/thread_pool.h"
 #include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <system_error>
+#include <tuple>
 
 namespace navground::onnx {
 
@@ -19,79 +28,335 @@ std::optional<size_t> SharedPolicy::index_of(const core::Behavior &behavior) {
   return std::nullopt;
 }
 
+void SharedPolicy::resize() {
+  std::map<const core::Behavior *,
+           std::pair<std::optional<TargetKey>, std::vector<ng_float_t>>>
+      rows;
+  for (size_t i = 0; i < _rows.size(); ++i) {
+    if (!_rows[i] || _recurrent_states.empty()) {
+      continue;
+    }
+    auto &[target, values] = rows[_rows[i]];
+    target = _recurrent_targets[i];
+    for (auto &state : _recurrent_states) {
+      if (!_consumed[i]) {
+        state.take_output(i);
+      }
+      state.save(i, values);
+    }
+  }
+  prepare(*(_behaviors.at(0)));
+  _rows = _behaviors;
+  _changed = false;
+  for (size_t i = 0; i < _rows.size(); ++i) {
+    const auto row = rows.find(_rows[i]);
+    if (row != rows.end()) {
+      _recurrent_targets[i] = row->second.first;
+      size_t offset = 0;
+      for (auto &state : _recurrent_states) {
+        offset = state.load(i, row->second.second, offset);
+      }
+    }
+  }
+  _observation_size = 0;
+  for (const auto &[_, buffer] : _sensings[0]->get_buffers()) {
+    _observation_size += buffer.size();
+  }
+  for (const auto &[_, buffer] : _state_buffers) {
+    _observation_size += buffer.size() / _batches;
+  }
+  _observed.resize(_batches * _observation_size);
+  _observation.resize(_observation_size);
+  // there are no results yet
+  _consumed.assign(_behaviors.size(), 1);
+}
+
+void SharedPolicy::observe(size_t index, FlatBufferIterator out) {
+  const auto &behavior = *_behaviors[index];
+  _ego_state.update(behavior, index);
+  _target_state.update(behavior, index);
+  flatten(out, _sensings[index]->get_buffers());
+  flatten(out, _state_buffers, index);
+}
+
+void SharedPolicy::update() {
+  std::lock_guard<std::mutex> lock(_group_mutex);
+  update_batch();
+}
+
+void SharedPolicy::update_batch() {
+  if (!_initialized || _changed) {
+    resize();
+  }
+  if (is_running()) {
+    // once for the whole group: the other behaviors read the fallback
+    // without skipping again
+    skip();
+    std::fill(_consumed.begin(), _consumed.end(), 0);
+    return;
+  }
+  for (size_t i = 0; i < _behaviors.size(); ++i) {
+    // the states of behaviors that have not read the last actions
+    // should not advance
+    if (!_consumed[i]) {
+      for (auto &state : _recurrent_states) {
+        state.take_output(i);
+      }
+    }
+    observe(i, std::begin(_observed) + i * _observation_size);
+    update_recurrent_states(*_behaviors[i], i);
+  }
+  if (observation_config.flat) {
+    std::copy(std::begin(_observed), std::end(_observed),
+              flat_buffer_interator());
+  } else {
+    gather_sensing();
+  }
+  std::fill(_consumed.begin(), _consumed.end(), 0);
+  run();
+}
+
+bool SharedPolicy::has_changed(size_t index) {
+  observe(index, std::begin(_observation));
+  const auto observed = std::begin(_observed) + index * _observation_size;
+  return !std::equal(std::begin(_observation), std::end(_observation),
+                     observed) ||
+         !has_same_target(*_behaviors[index], index);
+}
+
+bool SharedPolicy::has_next_changed(size_t index) {
+  const size_t next = (index + 1) % _behaviors.size();
+  return next != index && has_changed(next);
+}
+
+void SharedPolicy::update_row(size_t index) {
+  observe(index, std::begin(_observation));
+  std::copy(std::begin(_observation), std::end(_observation),
+            std::begin(_observed) + index * _observation_size);
+  // the state advances from the last one read by the behavior
+  if (!_consumed[index]) {
+    for (auto &state : _recurrent_states) {
+      state.take_output(index);
+    }
+  }
+  update_recurrent_states(*_behaviors[index], index);
+  if (observation_config.flat) {
+    std::copy(std::begin(_observation), std::end(_observation),
+              flat_buffer_interator() + index * _observation_size);
+  } else {
+    gather_sensing(index);
+  }
+  run_row(index);
+}
+
+void SharedPolicy::update_all(const std::vector<core::Behavior *> &behaviors) {
+  std::vector<SharedPolicy *> policies;
+  for (auto *behavior : behaviors) {
+    const auto *policy_behavior = dynamic_cast<PolicyBehavior *>(behavior);
+    if (!policy_behavior) {
+      continue;
+    }
+    auto *policy =
+        dynamic_cast<SharedPolicy *>(policy_behavior->get_policy());
+    if (policy && std::find(policies.begin(), policies.end(), policy) ==
+                      policies.end()) {
+      policies.push_back(policy);
+    }
+  }
+  ThreadPool::shared().run(policies.size(),
+                           [&policies](size_t i) { policies[i]->update(); });
+}
+
 core::Twist2 SharedPolicy::get_cmd(const core::Behavior &behavior,
                                    ng_float_t time_step) {
+  std::lock_guard<std::mutex> lock(_group_mutex);
   auto index = index_of(behavior);
   if (!index) {
     throw std::runtime_error(
         "Behavior does not belongs to this group of shared policies");
   }
-  // std::cout << "SharedPolicy::get_cmd " << *index << std::endl;
-  if (*index == 0) {
-    if (!_initialized) {
-      prepare(*(_behaviors.at(0)));
+  const size_t i = *index;
+  // The action computed by the last update is used only if the behavior
+  // has not read it yet and it was computed from the current observation,
+  // like for a policy that is not shared. Else, if the next behavior has not
+  // changed since the last update (i.e., when each behavior observes just
+  // before computing its command), the behavior runs inference alone, if
+  // possible. Else the whole group is updated.
+  if (!_initialized || _changed) {
+    update_batch();
+  } else if (is_running()) {
+    if (_consumed[i]) {
+      update_batch();
     }
-    size_t i = 0;
-    for (const auto &behavior : _behaviors) {
-      _ego_state.update(*behavior, i);
-      _target_state.update(*behavior, i);
-      i++;
+  } else {
+    const bool changed = has_changed(i);
+    if (changed && has_row_bindings() && !has_next_changed(i)) {
+      update_row(i);
+    } else if (changed || _consumed[i]) {
+      update_batch();
     }
-    if (observation_config.flat) {
-      i = 0;
-      auto out = flat_buffer_interator();
-      for (const auto &behavior : _behaviors) {
-        flatten(out, get_sensing(*behavior)->get_buffers());
-        flatten(out, _state_buffers, i);
-        i++;
-      }
+  }
+  _consumed[i] = 1;
+  return _action.get_cmd(behavior, time_step, i);
+}
+
+// Models may be rewritten in place, e.g., during training: hashes are
+// cached by path, modification time and size.
+static size_t hash_model(const std::filesystem::path &path) {
+  using Key = std::tuple<std::filesystem::path, std::filesystem::file_time_type,
+                         std::uintmax_t>;
+  static std::mutex mutex;
+  static std::map<Key, size_t> hashes;
+  std::error_code error;
+  const Key key{path, std::filesystem::last_write_time(path, error),
+                std::filesystem::file_size(path, error)};
+  std::lock_guard<std::mutex> lock(mutex);
+  const auto i = hashes.find(key);
+  if (i != hashes.end()) {
+    return i->second;
+  }
+  std::ifstream file(path, std::ios::binary);
+  const std::string content((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+  return hashes[key] = std::hash<std::string>()(content);
+}
+
+ModelSignature::ModelSignature(const core::Behavior &behavior,
+                               const std::filesystem::path &path)
+    : model(hash_model(path)), max_speed(behavior.get_max_speed()),
+      max_angular_speed(behavior.get_max_angular_speed()),
+      horizon(behavior.get_horizon()), sensing() {
+  if (const auto *state = get_sensing(behavior)) {
+    for (const auto &[key, buffer] : state->get_buffers()) {
+      sensing.emplace_back(key, buffer.size(),
+                           buffer.get_description().type);
     }
-    run();
   }
-  return _action.get_cmd(behavior, time_step, 2 * (*index));
 }
 
-std::vector<std::shared_ptr<SharedPolicy>> SharedPolicy::_policies = {};
+struct SharedPolicy::Registry {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<SharedPolicy>> policies;
+};
+
+// Worlds are stepped by a single thread, while different worlds may run in
+// parallel: groups are limited to the behaviors of the same thread.
+std::shared_ptr<SharedPolicy::Registry> SharedPolicy::get_registry() {
+  thread_local std::shared_ptr<Registry> registry =
+      std::make_shared<Registry>();
+  return registry;
+}
 
 SharedPolicy::SharedPolicy(const ControlActionConfig &action_config,
                            const DefaultObservationConfig &observation_config,
-                           const std::filesystem::path &path)
-    : Policy(action_config, observation_config, path), _behaviors() {}
+                           const std::filesystem::path &path,
+                           const InferenceConfig &inference_config)
+    : Policy(action_config, observation_config, path, inference_config),
+      _behaviors(), _rows(), _changed(false), _consumed(), _observed(),
+      _observation(), _observation_size(0), _signature(), _registry(),
+      _group_mutex() {}
 
 std::shared_ptr<SharedPolicy>
 SharedPolicy::join(const core::Behavior &behavior, const ControlActionConfig &action_config,
      const DefaultObservationConfig &observation_config,
-     const std::filesystem::path &path) {
-  auto i = std::find_if(
-      _policies.begin(), _policies.end(),
-      [&action_config, &observation_config, &path](const auto &policy) {
-        return (policy->action_config == action_config &&
-                policy->observation_config == observation_config &&
-                policy->path == path);
-      });
+     const std::filesystem::path &path,
+     const InferenceConfig &inference_config) {
+  auto registry = get_registry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  auto &policies = registry->policies;
+  auto i = std::find_if(policies.begin(), policies.end(),
+                        [&action_config, &observation_config, &path,
+                         &inference_config](const auto &policy) {
+                          return (!policy->_signature &&
+                                  policy->action_config == action_config &&
+                                  policy->observation_config ==
+                                      observation_config &&
+                                  policy->path == path &&
+                                  policy->inference_config == inference_config);
+                        });
   std::shared_ptr<SharedPolicy> policy;
-  if (i == _policies.end()) {
-    policy =
-        std::make_shared<SharedPolicy>(action_config, observation_config, path);
-    _policies.push_back(policy);
+  if (i == policies.end()) {
+    policy = std::make_shared<SharedPolicy>(action_config, observation_config,
+                                            path, inference_config);
+    policy->_registry = registry;
+    policies.push_back(policy);
   } else {
     policy = *i;
   }
-  policy->_behaviors.push_back(const_cast<core::Behavior *>(&behavior));
+  policy->add(behavior);
   return policy;
 }
 
+std::shared_ptr<SharedPolicy>
+SharedPolicy::join_auto(const core::Behavior &behavior,
+                        const ControlActionConfig &action_config,
+                        const DefaultObservationConfig &observation_config,
+                        const std::filesystem::path &path,
+                        const InferenceConfig &inference_config) {
+  ModelSignature signature(behavior, path);
+  auto registry = get_registry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  auto &policies = registry->policies;
+  auto i = std::find_if(policies.begin(), policies.end(),
+                        [&](const auto &policy) {
+                          return (policy->_signature == signature &&
+                                  policy->action_config == action_config &&
+                                  policy->observation_config ==
+                                      observation_config &&
+                                  policy->inference_config == inference_config);
+                        });
+  std::shared_ptr<SharedPolicy> policy;
+  if (i == policies.end()) {
+    policy = std::make_shared<SharedPolicy>(action_config, observation_config,
+                                            path, inference_config);
+    policy->_signature = std::move(signature);
+    policy->_registry = registry;
+    policies.push_back(policy);
+  } else {
+    policy = *i;
+  }
+  policy->add(behavior);
+  return policy;
+}
+
+void SharedPolicy::add(const core::Behavior &behavior) {
+  std::lock_guard<std::mutex> lock(_group_mutex);
+  _behaviors.push_back(const_cast<core::Behavior *>(&behavior));
+  _sensings.push_back(get_sensing(behavior));
+  _changed = true;
+}
+
 void SharedPolicy::leave(const core::Behavior &behavior) {
+  // behaviors may be destroyed in another thread than the one that steps
+  // the group
+  const auto registry = _registry.lock();
+  std::unique_lock<std::mutex> registry_lock;
+  if (registry) {
+    registry_lock = std::unique_lock<std::mutex>(registry->mutex);
+  }
+  std::unique_lock<std::mutex> lock(_group_mutex);
   const auto i = std::find(_behaviors.begin(), _behaviors.end(), &behavior);
-  if (i != _behaviors.end()) {
-    _behaviors.erase(i);
-    if (_behaviors.size() == 0) {
-      _policies.erase(std::remove_if(_policies.begin(), _policies.end(),
-                                     [this](const auto &policy) {
-                                       return policy.get() == this;
-                                     }),
-                      _policies.end());
-    }
+  if (i == _behaviors.end()) {
+    return;
+  }
+  // buffers are prepared again at the next update
+  const auto index = i - _behaviors.begin();
+  _sensings.erase(_sensings.begin() + index);
+  _behaviors.erase(i);
+  // the state of the row is lost, also for a new behavior at this address
+  std::replace(_rows.begin(), _rows.end(),
+               const_cast<core::Behavior *>(&behavior),
+               static_cast<core::Behavior *>(nullptr));
+  _changed = true;
+  const bool empty = _behaviors.empty();
+  lock.unlock();
+  if (empty && registry) {
+    auto &policies = registry->policies;
+    policies.erase(std::remove_if(policies.begin(), policies.end(),
+                                  [this](const auto &policy) {
+                                    return policy.get() == this;
+                                  }),
+                   policies.end());
   }
 }
 
@@ -3,16 +3,19 @@
  */
 
 #include "navground_onnx/tensor_utils.h"
+#include <stdexcept>
 
 namespace navground::onnx {
 
-Ort::Value make_tensor(const core::Buffer &buffer) {
+Ort::Value make_tensor(const core::Buffer &buffer, bool add_batch_dimension) {
   const auto sshape = buffer.get_shape();
   const size_t size = buffer.size();
-  std::vector<int64_t> shape(sshape.size());
-  // 1 batch
-  // shape[0] = 1;
-  std::copy(sshape.begin(), sshape.end(), shape.begin());
+  std::vector<int64_t> shape;
+  shape.reserve(sshape.size() + 1);
+  if (add_batch_dimension) {
+    shape.push_back(1);
+  }
+  shape.insert(shape.end(), sshape.begin(), sshape.end());
 
   return std::visit(
       [&shape, size](auto &&arg) {
@@ -27,4 +30,31 @@ Ort::Value make_tensor(const core::Buffer &buffer) {
       buffer.get_data_container());
 }
 
+Ort::Value make_tensor(const core::Buffer &buffer, size_t axis,
+                       size_t index) {
+  const auto sshape = buffer.get_shape();
+  std::vector<int64_t> shape(sshape.begin(), sshape.end());
+  if (axis >= shape.size()) {
+    throw std::runtime_error("Cannot slice a tensor along a missing axis");
+  }
+  for (size_t i = 0; i < axis; ++i) {
+    if (shape[i] != 1) {
+      throw std::runtime_error("Cannot slice a tensor in contiguous parts");
+    }
+  }
+  const size_t size = buffer.size() / shape[axis];
+  shape[axis] = 1;
+  return std::visit(
+      [&shape, size, index](auto &&arg) {
+        using Q = std::remove_reference_t<decltype(arg[0])>;
+        using T = std::remove_const_t<Q>;
+        T *data = const_cast<T *>(&(arg[0])) + index * size;
+        const Ort::MemoryInfo memory_info =
+            Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+        return Ort::Value::CreateTensor<T>(memory_info, data, size,
+                                           shape.data(), shape.size());
+      },
+      buffer.get_data_container());
+}
+
 } // namespace navground::onnx
@@ -0,0 +1,119 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#include "navground_onnx/thread_pool.h"
+#include <algorithm>
+
+namespace navground::onnx {
+
+ThreadPool::ThreadPool(unsigned number_of_threads)
+    : _threads(), _caller(), _mutex(), _start(), _done(), _task(nullptr),
+      _size(0), _next(0), _pending(0), _active(0), _generation(0),
+      _stop(false), _exception() {
+  for (unsigned i = 0; i < number_of_threads; ++i) {
+    _threads.emplace_back(&ThreadPool::work, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _start.notify_all();
+  for (auto &thread : _threads) {
+    thread.join();
+  }
+}
+
+ThreadPool &ThreadPool::shared() {
+  static ThreadPool pool(
+      std::max(1u, std::thread::hardware_concurrency()) - 1);
+  return pool;
+}
+
+void ThreadPool::run(size_t number,
+                     const std::function<void(size_t)> &task) {
+  if (number == 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> caller(_caller, std::try_to_lock);
+  if (number == 1 || _threads.empty() || !caller) {
+    for (size_t i = 0; i < number; ++i) {
+      task(i);
+    }
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    // wait for workers still leaving the previous run
+    _done.wait(lock, [this] { return _active == 0; });
+    _task = &task;
+    _size = number;
+    _next = 0;
+    _pending = number;
+    _exception = nullptr;
+    _generation++;
+  }
+  _start.notify_all();
+  consume();
+  std::exception_ptr exception;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [this] { return _pending == 0; });
+    _task = nullptr;
+    std::swap(exception, _exception);
+  }
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+}
+
+void ThreadPool::consume() {
+  for (;;) {
+    const size_t i = _next++;
+    if (i >= _size) {
+      return;
+    }
+    std::exception_ptr exception;
+    try {
+      (*_task)(i);
+    } catch (...) {
+      exception = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (exception && !_exception) {
+      _exception = exception;
+    }
+    if (--_pending == 0) {
+      _done.notify_all();
+    }
+  }
+}
+
+void ThreadPool::work() {
+  unsigned generation = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _start.wait(lock, [this, generation] {
+        return _stop || _generation != generation;
+      });
+      if (_stop) {
+        return;
+      }
+      generation = _generation;
+      _active++;
+    }
+    consume();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (--_active == 0) {
+        _done.notify_all();
+      }
+    }
+  }
+}
+
+} // namespace navground::onnx
@@ -0,0 +1,34 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+#include "navground_onnx/world.h"
+#include "navground_onnx/shared_policy.h"
+
+#include <vector>
+
+namespace navground::onnx {
+
+void update_shared_policies(sim::World &world) {
+  std::vector<core::Behavior *> behaviors;
+  for (const auto &agent : world.get_agents()) {
+    auto *behavior = agent->get_behavior();
+    if (!behavior) {
+      continue;
+    }
+    // the agent senses again when it updates: if the world has not changed
+    // (and sensing is deterministic), it then reads the action computed here
+    if (auto *state_estimation = agent->get_state_estimation()) {
+      state_estimation->update(agent.get(), &world,
+                               behavior->get_environment_state());
+    }
+    behaviors.push_back(behavior);
+  }
+  SharedPolicy::update_all(behaviors);
+}
+
+void add_shared_policies_callback(sim::World &world) {
+  world.add_callback([&world]() { update_shared_policies(world); });
+}
+
+} // namespace navground::onnx
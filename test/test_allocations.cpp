@@ -0,0 +1,142 @@
+/**
+ * @author Jerome Guzzi - <jerome@idsia.ch>
+ */
+
+// Checks that, after warm-up, computing a command does not allocate: the
+// only allocations are those performed by the onnx runtime when running the
+// session and by navground_core when making the command feasible.
+
+#include "navground/core/kinematics.h"
+#include "navground/core/target.h"
+#include "navground_onnx/policy_behavior.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+
+static std::atomic<bool> counting{false};
+static std::atomic<size_t> allocations{0};
+
+void *operator new(std::size_t size) {
+  if (counting) {
+    allocations++;
+  }
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+using navground::onnx::Policy;
+using navground::onnx::PolicyBehavior;
+
+static const ng_float_t time_step = 0.1;
+static const unsigned warmup_steps = 5;
+static const unsigned steps = 100;
+
+template <typename F> static size_t count_allocations(F &&f) {
+  allocations = 0;
+  counting = true;
+  for (unsigned i = 0; i < steps; ++i) {
+    f();
+  }
+  counting = false;
+  return allocations;
+}
+
+struct Case {
+  const char *name;
+  unsigned number;
+  bool shared;
+  bool use_wheels;
+  bool use_acceleration_action;
+};
+
+static std::vector<std::unique_ptr<PolicyBehavior>>
+make_behaviors(const Case &c) {
+  std::vector<std::unique_ptr<PolicyBehavior>> behaviors;
+  for (unsigned i = 0; i < c.number; ++i) {
+    // the action of the model has two values: wheel speeds or longitudinal
+    // and angular speeds, also for holonomic agents
+    std::shared_ptr<navground::core::Kinematics> kinematics;
+    if (c.use_wheels) {
+      kinematics = std::make_shared<
+          navground::core::TwoWheelsDifferentialDriveKinematics>(0.12, 0.094);
+    } else {
+      kinematics =
+          std::make_shared<navground::core::OmnidirectionalKinematics>(0.12, 1);
+    }
+    auto behavior =
+        std::make_unique<PolicyBehavior>(kinematics, 0.08, MODEL_PATH);
+    behavior->observation_config.include_target_direction = true;
+    behavior->observation_config.flat = true;
+    behavior->action_config.use_wheels = c.use_wheels;
+    behavior->action_config.use_acceleration_action =
+        c.use_acceleration_action;
+    behavior->set_shared(c.shared);
+    behavior->set_auto_shared(false);
+    behavior->set_target(
+        navground::core::Target::Direction(navground::core::Vector2(1, 0)));
+    behaviors.push_back(std::move(behavior));
+  }
+  return behaviors;
+}
+
+static bool check(const Case &c) {
+  auto behaviors = make_behaviors(c);
+  std::vector<navground::core::Twist2> cmds(behaviors.size());
+  auto step = [&behaviors, &cmds]() {
+    for (size_t i = 0; i < behaviors.size(); ++i) {
+      cmds[i] = behaviors[i]->compute_cmd_internal(time_step);
+    }
+  };
+  for (unsigned i = 0; i < warmup_steps; ++i) {
+    step();
+  }
+  std::vector<Policy *> policies;
+  for (const auto &behavior : behaviors) {
+    auto *policy = behavior->get_policy();
+    if (std::find(policies.begin(), policies.end(), policy) ==
+        policies.end()) {
+      policies.push_back(policy);
+    }
+  }
+  // what the step does outside of the plugin
+  auto external = [&behaviors, &cmds, &policies]() {
+    for (auto *policy : policies) {
+      policy->run();
+    }
+    for (size_t i = 0; i < behaviors.size(); ++i) {
+      behaviors[i]->feasible_twist(cmds[i]);
+    }
+  };
+  external();
+  const size_t expected = count_allocations(external);
+  const size_t actual = count_allocations(step);
+  const auto added = static_cast<long>(actual) - static_cast<long>(expected);
+  std::cout << c.name << ": " << added << " allocations added in " << steps
+            << " steps (onnxruntime and navground_core: " << expected << ")"
+            << std::endl;
+  return added == 0;
+}
+
+int main() {
+  const Case cases[] = {
+      {"Policy", 2, false, false, false},
+      {"SharedPolicy", 4, true, false, false},
+      {"Policy with wheel accelerations", 2, false, true, true},
+      {"SharedPolicy with wheel accelerations", 4, true, true, true},
+  };
+  bool ok = true;
+  for (const auto &c : cases) {
+    ok = check(c) && ok;
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}